@@ -0,0 +1,39 @@
+#!/bin/sh
+# Runs the same batch of scripts with --jobs at several thread counts and
+# prints one CSV row per count:
+#
+#   jobs,runs,exec_ms,runs_per_sec,speedup
+#
+# The batch runs every benchmark in bench/ a number of times, so with
+# enough cores runs per second should grow with the number of jobs.
+#
+# Usage: bench/jobs.sh [lantern] [repeats] [job counts...]
+
+LANTERN=${1:-bin/lantern}
+REPEATS=${2:-20}
+shift 2 2> /dev/null
+JOB_COUNTS=${*:-1 2 4 8}
+BENCH_DIR=$(dirname "$0")
+
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+i=0
+while [ "$i" -lt "$REPEATS" ]; do
+    ls "$BENCH_DIR"/*.lntrn >> "$TMP_DIR/list"
+    i=$((i + 1))
+done
+
+echo "jobs,runs,exec_ms,runs_per_sec,speedup"
+base=""
+for jobs in $JOB_COUNTS; do
+    "$LANTERN" --jobs "$jobs" --inputs "$TMP_DIR/list" --stats > /dev/null 2> "$TMP_DIR/stats"
+    row=$(awk -v jobs="$jobs" '
+        /exec: / { for(i = 1; i <= NF; i++) if($i == "exec:") exec = $(i + 1) }
+        /runs: / { for(i = 1; i <= NF; i++) if($i == "runs:") runs = $(i + 1) + 0 }
+        END { printf "%d,%d,%s,%.1f", jobs, runs, exec, (exec > 0 ? runs * 1000 / exec : 0) }
+    ' "$TMP_DIR/stats")
+    rate=$(echo "$row" | cut -d, -f4)
+    [ -z "$base" ] && base=$rate
+    echo "$row" | awk -F, -v base="$base" '{ printf "%s,%.2f\n", $0, (base > 0 ? $4 / base : 0) }'
+done
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs every benchmark in bench/ and prints one CSV row per run:
+#
+#   benchmark,run,load_ms,exec_ms,instructions,minst_per_sec,peak_rss_kb
+#
+# Instruction counts come from a build with -DLANTERN_COUNT_INSTRUCTIONS,
+# which is run once per benchmark so the timed runs pay nothing for them.
+#
+# Usage: bench/run.sh [lantern] [counting lantern] [runs]
+
+LANTERN=${1:-bin/lantern}
+LANTERN_COUNT=${2:-bin/lantern-count}
+RUNS=${3:-5}
+BENCH_DIR=$(dirname "$0")
+
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+# A long script of mixed statements that mostly measures load time.
+awk 'BEGIN {
+    print "macro wrap def 1000 % end"
+    print "0 = x"
+    for(i = 0; i < 20000; i++) {
+        printf "x %d + $wrap = x\n", i
+        if(i % 10 == 0) printf "\"literal %d\" = s%d\n", i, i % 50
+        if(i % 25 == 0) printf "x 500 > if\n    x 2 / = x\nelif x 250 > then\n    x 3 - = x\nend\n"
+        if(i % 100 == 0) printf "0 = k%d\nwhile k%d 10 < run\n    k%d 1 + = k%d\nend\n", i, i, i, i
+    }
+    print "x println"
+}' > "$TMP_DIR/large.lntrn"
+
+# Prints "load_ms exec_ms peak_rss_kb instructions" from --stats output.
+parse_stats() {
+    awk '
+        /load: / {
+            for(i = 1; i <= NF; i++) {
+                if($i == "load:") load = $(i + 1)
+                if($i == "exec:") exec = $(i + 1)
+                if($i == "rss:") rss = $(i + 1)
+            }
+        }
+        /instructions: / { inst = $NF }
+        END { print load, exec, rss, (inst == "" ? 0 : inst) }
+    ' "$1"
+}
+
+run_benchmark() {
+    name=$1
+    script=$2
+    shift 2
+    instructions=0
+    if [ -x "$LANTERN_COUNT" ]; then
+        "$LANTERN_COUNT" --stats "$@" "$script" > /dev/null 2> "$TMP_DIR/stats"
+        instructions=$(parse_stats "$TMP_DIR/stats" | awk '{ print $4 }')
+    fi
+    run=1
+    while [ "$run" -le "$RUNS" ]; do
+        "$LANTERN" --stats "$@" "$script" > /dev/null 2> "$TMP_DIR/stats"
+        parse_stats "$TMP_DIR/stats" | awk -v name="$name" -v run="$run" -v inst="$instructions" '{
+            printf "%s,%d,%s,%s,%s,%.1f,%s\n", name, run, $1, $2, inst, ($2 > 0 ? inst / ($2 * 1000) : 0), $3
+        }'
+        run=$((run + 1))
+    done
+}
+
+echo "benchmark,run,load_ms,exec_ms,instructions,minst_per_sec,peak_rss_kb"
+for script in "$BENCH_DIR"/*.lntrn; do
+    run_benchmark "$(basename "$script" .lntrn)" "$script" --no-cache
+done
+run_benchmark large "$TMP_DIR/large.lntrn" --no-cache
+# Measures loading from the .lntc cache, which the first run writes.
+run_benchmark large-cached "$TMP_DIR/large.lntrn" --cache-dir "$TMP_DIR/cache"
@@ -1,16 +1,55 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "lantern.h"
 
-#define STACK_CAP 64
-#define STACKFRAME_CAP 256
-#define PROGRAM_CAP 1024
 #define MAX_WORD_SIZE 256
 
+// Dispatch through a table of label addresses where the compiler supports
+// it, otherwise fall back to a plain switch.
+#if defined(__GNUC__) && !defined(LANTERN_NO_COMPUTED_GOTO)
+#define LANTERN_COMPUTED_GOTO
+#endif
+
+// --jit compiles hot loops to x86-64 machine code, which needs the System V
+// calling convention and memory that can be mapped executable.
+#if defined(__x86_64__) && defined(__linux__) && !defined(LANTERN_NO_JIT)
+#define LANTERN_JIT
+#endif
+
+#define GROW_ARRAY(arr, count, cap) {                                                  \
+    if((count) >= (cap)) {                                                              \
+        (cap) = (cap) ? (cap) * 2 : 64;                                                 \
+        (arr) = realloc((arr), sizeof(*(arr)) * (cap));                                 \
+        PANIC_ON_ERR(!(arr), ERR_OUT_OF_MEMORY, "Cannot grow a table to %u entries.",   \
+                     (uint32_t)(cap));                                                  \
+        if(!(arr)) exit(1);                                                             \
+    }                                                                                   \
+}                                                                                       \
+
+// Like GROW_ARRAY, for tables the memory budget is charged for.
+#define GROW_BUFFER(state, arr, count, cap)                                             \
+    ((arr) = grow_buffer((state), (arr), &(cap), (count) + 1, sizeof(*(arr))))          \
+
 #define PANIC_ON_ERR(cond, err_type, ...)  {                                            \
     if(cond) {                                                                          \
         printf("Lantern: Error: %s | Error Code: %i\n", #err_type, (int32_t)err_type);  \
@@ -27,19 +66,110 @@ typedef enum {
     INST_LOGICAL_AND, INST_LOGICAL_OR,
     INST_IF,INST_ELSE, INST_ELIF, INST_THEN, INST_ENDIF,
     INST_WHILE, INST_RUN_WHILE, INST_END_WHILE,
+    INST_PWHILE, INST_END_PWHILE,
     INST_PRINT, INST_PRINTLN,
     INST_JUMP,
     INST_ADD_VAR_TO_STACKFRAME, INST_ASSIGN, INST_VAR_USAGE, INST_VAR_REASSIGN,
     INST_HEAP_ALLOC, INST_HEAP_FREE, INST_PTR_GET_I, INST_PTR_SET_I,
     INST_INT_TYPE, INST_STR_TYPE,
-    INST_MACRO, INST_MACRO_DEF, INST_END_MACRO, INST_MACRO_USAGE
+    INST_VAR_ADD_CONST, INST_VAR_SUB_CONST, INST_VAR_MOD_CONST_CMP_CONST,
+    INST_VAR_CMP_CONST_RUN, INST_VAR_CMP_CONST_IF, INST_VAR_PGET, INST_VAR_PSET,
+    INST_FILL, INST_COPY, INST_COMPARE, INST_SUM, INST_MIN, INST_MAX, INST_SORT,
+    // Forms of + == and != for one operand type, which exec_program 
+    // rewrites the generic ones into once it has seen their operands.
+    INST_PLUS_INT, INST_PLUS_STR, INST_EQ_INT, INST_EQ_STR, INST_NEQ_INT, INST_NEQ_STR,
+    INST_HALT
 } Instruction;
 
+#define INST_COUNT (INST_HALT + 1)
+
+// Source spelling of each instruction, for profiles.
+const char* inst_names[INST_COUNT] = {
+    [INST_STACK_PUSH] = "push", [INST_STACK_PREV] = "prev",
+    [INST_PLUS] = "+", [INST_MINUS] = "-", [INST_MUL] = "*", [INST_DIV] = "/", [INST_MOD] = "%",
+    [INST_EQ] = "==", [INST_NEQ] = "!=", [INST_GT] = ">", [INST_LT] = "<", [INST_GEQ] = ">=", [INST_LEQ] = "<=",
+    [INST_LOGICAL_AND] = "and", [INST_LOGICAL_OR] = "or",
+    [INST_IF] = "if", [INST_ELSE] = "else", [INST_ELIF] = "elif", [INST_THEN] = "then", [INST_ENDIF] = "end",
+    [INST_WHILE] = "while", [INST_RUN_WHILE] = "run", [INST_END_WHILE] = "end while",
+    [INST_PWHILE] = "pwhile", [INST_END_PWHILE] = "end pwhile",
+    [INST_PRINT] = "print", [INST_PRINTLN] = "println", [INST_JUMP] = "jmp",
+    [INST_ADD_VAR_TO_STACKFRAME] = "declare", [INST_ASSIGN] = "=", 
+    [INST_VAR_USAGE] = "var", [INST_VAR_REASSIGN] = "assign",
+    [INST_HEAP_ALLOC] = "alloc", [INST_HEAP_FREE] = "free", [INST_PTR_GET_I] = "pget", [INST_PTR_SET_I] = "pset",
+    [INST_INT_TYPE] = "int", [INST_STR_TYPE] = "str",
+    [INST_VAR_ADD_CONST] = "var+const", [INST_VAR_SUB_CONST] = "var-const", 
+    [INST_VAR_MOD_CONST_CMP_CONST] = "var%const==const", [INST_VAR_CMP_CONST_RUN] = "var<const run", 
+    [INST_VAR_CMP_CONST_IF] = "var<const if", [INST_VAR_PGET] = "var pget", [INST_VAR_PSET] = "var pset",
+    [INST_FILL] = "fill", [INST_COPY] = "copy", [INST_COMPARE] = "compare", 
+    [INST_SUM] = "sum", [INST_MIN] = "min", [INST_MAX] = "max", [INST_SORT] = "sort",
+    [INST_PLUS_INT] = "+ int", [INST_PLUS_STR] = "+ str", [INST_EQ_INT] = "== int", [INST_EQ_STR] = "== str",
+    [INST_NEQ_INT] = "!= int", [INST_NEQ_STR] = "!= str",
+    [INST_HALT] = "halt"
+};
+
+// What an instruction needs of the values it pops.
+typedef enum {
+    OPERANDS_ANY,
+    // Every value it pops is an int.
+    OPERANDS_INT,
+    // Two ints or two strings.
+    OPERANDS_SAME
+} OperandRule;
+
+typedef struct {
+    uint8_t pops;
+    uint8_t pushes;
+    uint8_t rule;
+} StackEffect;
+
+// The stack effect of each instruction, which the verifier proves and 
+// unverified programs check before every instruction. Superinstructions
+// guard their own operands and fall back to the plain sequence.
+const StackEffect stack_effects[INST_COUNT] = {
+    [INST_STACK_PUSH] = {0, 1, OPERANDS_ANY}, [INST_STACK_PREV] = {2, 2, OPERANDS_ANY},
+    [INST_PLUS] = {2, 1, OPERANDS_SAME}, [INST_MINUS] = {2, 1, OPERANDS_INT}, [INST_MUL] = {2, 1, OPERANDS_INT},
+    [INST_DIV] = {2, 1, OPERANDS_INT}, [INST_MOD] = {2, 1, OPERANDS_INT},
+    [INST_EQ] = {2, 1, OPERANDS_SAME}, [INST_NEQ] = {2, 1, OPERANDS_SAME},
+    [INST_GT] = {2, 1, OPERANDS_INT}, [INST_LT] = {2, 1, OPERANDS_INT}, 
+    [INST_GEQ] = {2, 1, OPERANDS_INT}, [INST_LEQ] = {2, 1, OPERANDS_INT},
+    [INST_LOGICAL_AND] = {2, 1, OPERANDS_INT}, [INST_LOGICAL_OR] = {2, 1, OPERANDS_INT},
+    [INST_IF] = {1, 0, OPERANDS_INT}, [INST_THEN] = {1, 0, OPERANDS_INT}, [INST_RUN_WHILE] = {1, 0, OPERANDS_INT},
+    [INST_PWHILE] = {2, 1, OPERANDS_INT},
+    [INST_PRINT] = {1, 0, OPERANDS_ANY}, [INST_PRINTLN] = {1, 0, OPERANDS_ANY}, 
+    [INST_JUMP] = {1, 0, OPERANDS_INT},
+    [INST_ADD_VAR_TO_STACKFRAME] = {1, 0, OPERANDS_ANY}, [INST_VAR_REASSIGN] = {1, 0, OPERANDS_ANY},
+    [INST_VAR_USAGE] = {0, 1, OPERANDS_ANY},
+    [INST_HEAP_ALLOC] = {1, 1, OPERANDS_INT}, [INST_HEAP_FREE] = {1, 0, OPERANDS_ANY},
+    [INST_PTR_GET_I] = {2, 1, OPERANDS_ANY}, [INST_PTR_SET_I] = {3, 0, OPERANDS_ANY},
+    [INST_FILL] = {4, 0, OPERANDS_ANY}, [INST_COPY] = {5, 0, OPERANDS_ANY}, [INST_COMPARE] = {5, 1, OPERANDS_ANY},
+    [INST_SUM] = {3, 1, OPERANDS_ANY}, [INST_MIN] = {3, 1, OPERANDS_ANY}, [INST_MAX] = {3, 1, OPERANDS_ANY}, 
+    [INST_SORT] = {3, 0, OPERANDS_ANY},
+    [INST_PLUS_INT] = {2, 1, OPERANDS_SAME}, [INST_PLUS_STR] = {2, 1, OPERANDS_SAME},
+    [INST_EQ_INT] = {2, 1, OPERANDS_SAME}, [INST_EQ_STR] = {2, 1, OPERANDS_SAME},
+    [INST_NEQ_INT] = {2, 1, OPERANDS_SAME}, [INST_NEQ_STR] = {2, 1, OPERANDS_SAME}
+};
+
+// The operand of the end of a pwhile loop: its reduction word (sum, min, 
+// max or 0 for none) and above it the number of variables in scope outside
+// of the loop.
+#define PWHILE_REDUCTION(operand) ((Instruction)((operand) & 0xff))
+#define PWHILE_OUTER_SLOTS(operand) ((uint32_t)((operand) >> 8))
+
 typedef enum {
     VAR_TYPE_INT,
     VAR_TYPE_STR
 } VariableType;
 
+// Element types of heap blocks. The integer types are numbered by the log2
+// of their width and hold ints truncated to that width.
+typedef enum {
+    ELEM_I8,
+    ELEM_I16,
+    ELEM_I32,
+    ELEM_I64,
+    ELEM_STR
+} ElementType;
+
 typedef enum {
     ERR_STACK_OVERFLOW,
     ERR_STACK_UNDERFLOW,
@@ -49,85 +179,351 @@ typedef enum {
     ERR_ILLEGAL_INSTRUCTION,
     ERR_SYNTAX_ERROR,
     ERR_INVALID_PTR,
+    ERR_DIVISION_BY_ZERO,
+    ERR_OUT_OF_MEMORY,
+    ERR_OUT_OF_BOUNDS,
 } Error;
 
+// Values are NaN-boxed into 64 bits. Every bit pattern that is not a quiet
+// NaN with tag bits set is left free for doubles, the remaining ones carry
+// a tag in bits 48-50 and a payload below it: a 32 bit integer or the heap
+// handle of a string or an allocated block.
+typedef uint64_t RuntimeValue;
+
+#define VALUE_QNAN      0x7ff8000000000000ULL
+#define VALUE_TAG_SHIFT 48
+#define VALUE_TAG_MASK  (7ULL << VALUE_TAG_SHIFT)
+
+typedef enum {
+    VALUE_TAG_INT = 1,
+    VALUE_TAG_STR,
+    VALUE_TAG_PTR
+} ValueTag;
+
+#define VALUE_BOX(tag, payload) (VALUE_QNAN | ((uint64_t)(tag) << VALUE_TAG_SHIFT) | (payload))
+
+// Heap values are referred to by handles: the low 32 bits index the heap
+// table, the 16 bits above hold the generation of the slot when the handle
+// was made. Freeing a slot bumps its generation, so stale handles no 
+// longer resolve. A slot whose generation runs out is retired instead of 
+// reused.
+typedef uint64_t HeapHandle;
+
+#define HANDLE_GENERATION_SHIFT 32
+#define HANDLE_GENERATION_MAX UINT16_MAX
+
+typedef enum {
+    HEAP_SLOT_FREE,
+    HEAP_SLOT_BLOCK,    // allocated with alloc, released with free
+    HEAP_SLOT_STRING,   // created at runtime, reclaimed by collect_garbage
+    HEAP_SLOT_LITERAL   // referenced by the program, lives in the string arena
+} HeapSlotKind;
+
+// Strings are immutable and interned, so two live strings with the same
+// contents always share a slot and compare equal by handle.
 typedef struct {
-    size_t data;
-    VariableType var_type;
-    bool heap_ptr;
-} RuntimeValue;
+    uint64_t hash;
+    uint32_t len;
+    char data[];
+} String;
 
 typedef struct {
     void* data;
-    VariableType var_type;
+    // Bytes requested for the data, pooled when it is at most POOL_MAX_SIZE.
+    // For blocks the length is size divided by the element width.
+    uint32_t size;
+    uint8_t elem_type;
+    uint8_t kind;
+    uint16_t generation;
 } HeapValue;
 
+// Blocks of up to POOL_MAX_SIZE bytes are rounded up to a power of two 
+// size class and carved out of POOL_SLAB_SIZE slabs. Free blocks of a 
+// class are kept in a list threaded through the blocks themselves.
+#define POOL_MIN_SIZE 16
+#define POOL_CLASS_COUNT 9
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASS_COUNT - 1))
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+// Executions and cycles spent per token.
 typedef struct {
-    Instruction inst;
-    RuntimeValue val;
-} Token;
+    uint64_t* counts;
+    uint64_t* cycles;
+} Profile;
+
+// Loops compiled to machine code with --jit.
+typedef struct JitLoop JitLoop;
 
 typedef struct {
-    RuntimeValue val;
-    uint32_t frame_index;
-} StackFrameValue;
+    // Per token: the compiled loop whose condition starts there and how 
+    // often the loop came back to it before it was compiled.
+    JitLoop** loops;
+    uint32_t* hits;
+    uint32_t loops_compiled;
+    uint64_t early_exits;
+} JitState;
+
+// Collections run once the strings allocated since the last one add up to
+// the bytes still live after it, but never before GC_MIN_THRESHOLD.
+#define GC_MIN_THRESHOLD (256 * 1024)
+
+typedef struct {
+    uint32_t collections;
+    uint64_t strings_freed;
+    uint64_t pause_total_ns;
+    uint64_t pause_max_ns;
+} GCStats;
+
+// The program is stored as two parallel arrays so the dispatch loop reads
+// one byte per instruction and only touches the operand when it needs it.
+// Operands are either a value to push or a raw index (jump target, 
+// stackframe slot).
+typedef struct {
+    uint32_t line;
+    uint32_t column;
+    // The macro expansion the token was produced by.
+    uint32_t call;
+} TokenPos;
+
+// A use of a macro. 'pos.call' is the expansion it appears in, so the 
+// calls of a token form a chain back to the top level.
+typedef struct {
+    TokenPos pos;
+    char* name;
+} MacroCall;
 
 typedef struct {
-    RuntimeValue stack[STACK_CAP];
+    uint8_t* insts;
+    RuntimeValue* operands;
+    uint32_t size;
+    uint32_t cap;
+    // The most variables that are ever in scope at once.
+    uint32_t frame_slots;
+    // Set when verify_program proved the stack effects of every 
+    // instruction, which lets exec_program skip checking them.
+    bool verified;
+
+    // Where each token came from, only recorded for profiling. 
+    // macro_calls[0] stands for the top level of the script.
+    TokenPos* positions;
+    MacroCall* macro_calls;
+    uint32_t macro_call_count;
+    uint32_t macro_call_cap;
+} Program;
+
+typedef struct ProgramState {
+    // stack[0] is scratch space for exec_program, values start at stack[1].
+    RuntimeValue* stack;
     int32_t stack_size;
+    uint32_t stack_cap;
 
     HeapValue* heap;
     uint32_t heap_size;
+    uint32_t heap_cap;
+    uint32_t* free_slots;
+    uint32_t free_slot_count;
+    uint32_t free_slot_cap;
+
+    PoolBlock* pools[POOL_CLASS_COUNT];
+    void** slabs;
+    uint32_t slab_count;
+    uint32_t slab_cap;
 
-    StackFrameValue stackframe[STACKFRAME_CAP];
+    // Literals are never freed and are bump allocated from slabs of their own.
+    char* arena;
+    size_t arena_used;
+    size_t arena_cap;
+
+    // Interned strings by hash, holding heap slot indices plus one.
+    uint32_t* string_buckets;
+    uint32_t string_bucket_count;
+    uint32_t string_count;
+
+    // Variable values and the frame depth they were declared at, split so
+    // variable reads stay within the value array.
+    RuntimeValue* stackframe;
+    uint32_t* stackframe_depths;
     uint32_t stackframe_size;
     uint32_t stackframe_index;
 
     uint32_t inst_ptr;
     uint32_t program_size;
 
-    uint32_t call_positions[STACK_CAP];
-    uint32_t call_positions_count;
+    // print and println append here, the buffer is written to stdout when
+    // it fills up, on exit and before runtime errors are reported.
+    char* output;
+    size_t output_size;
+    size_t output_cap;
+    // Flush after every println, for interactive use.
+    bool line_buffered;
+    // Check pget and pset indices against the block length.
+    bool check_bounds;
+    // Receives the output instead of stdout when set, runtime errors
+    // included.
+    void (*output_sink)(void* context, const char* data, size_t size);
+    void* output_context;
+    // Threads a pwhile loop may split its range across, 1 runs it in order.
+    uint32_t threads;
+    // The pwhile worker running the state. Workers share the instructions 
+    // with other threads and so never rewrite them.
+    struct PWhileWorker* pwhile;
+
+    // Bytes allocated for the structures above and for heap blocks, checked
+    // against memory_limit (0 means no limit).
+    size_t memory_used;
+    size_t memory_limit;
+    size_t memory_peak;
+
+    // String bytes allocated since the last collection, which runs once
+    // they reach gc_threshold.
+    size_t gc_allocated;
+    size_t gc_threshold;
+    GCStats gc_stats;
+    // Allocated when the program runs with --profile.
+    Profile* profile;
+    // Allocated when the program runs with --jit.
+    JitState* jit;
+    // Instructions dispatched, only counted in builds with
+    // LANTERN_COUNT_INSTRUCTIONS since it costs an add per instruction.
+    uint64_t inst_count;
+    // Generic instructions rewritten into a form for one operand type, and
+    // such forms rewritten back after seeing another type.
+    uint64_t specializations;
+    uint64_t deoptimizations;
 
-    uint32_t macro_positions[PROGRAM_CAP];
-    uint32_t macro_count;
-    bool found_solution_for_if_block;
 } ProgramState;
 
+typedef struct {
+    void* data;
+    size_t size;
+} MappedFile;
+
+typedef struct {
+    const char* data;
+    uint32_t len;
+} StrSlice;
+
+#define SYMBOL_NONE UINT32_MAX
+
+// Identifiers are interned once per load. A symbol carries everything the
+// loader needs to resolve the name: its stackframe slot while it is in
+// scope as a variable and its body when it names a macro.
+typedef struct {
+    StrSlice name;
+    uint32_t hash;
+    uint32_t var_slot;
+    StrSlice macro_body;
+    bool expanding;
+} Symbol;
+
+typedef struct {
+    Symbol* symbols;
+    uint32_t symbol_count;
+    uint32_t symbol_cap;
+
+    // Open addressing, each bucket holds a symbol index + 1 (0 is empty).
+    uint32_t* buckets;
+    uint32_t bucket_count;
+} SymbolTable;
+
+typedef struct {
+    uint32_t symbol;
+    uint32_t depth;
+} ScopeVariable;
+
+typedef struct {
+    const char* src;
+    size_t size;
+    size_t pos;
+} Lexer;
+
+typedef struct {
+    Lexer lexer;
+    uint32_t symbol;
+} MacroExpansion;
+
+RuntimeValue
+value_int(int32_t val) {
+    return VALUE_BOX(VALUE_TAG_INT, (uint32_t)val);
+}
+
+RuntimeValue
+value_str(HeapHandle handle) {
+    return VALUE_BOX(VALUE_TAG_STR, handle);
+}
+
+RuntimeValue
+value_ptr(HeapHandle handle) {
+    return VALUE_BOX(VALUE_TAG_PTR, handle);
+}
+
+ValueTag
+value_tag(RuntimeValue val) {
+    return (val & VALUE_TAG_MASK) >> VALUE_TAG_SHIFT;
+}
+
+// The payload of an integer, or the heap slot index of a string or pointer.
+int32_t
+value_payload(RuntimeValue val) {
+    return (int32_t)(uint32_t)val;
+}
+
+bool
+value_is_heap(RuntimeValue val) {
+    return value_tag(val) != VALUE_TAG_INT;
+}
+
+// Pointers are integers as far as arithmetic and type checks go, only 
+// strings are a type of their own.
+VariableType
+value_type(RuntimeValue val) {
+    return value_tag(val) == VALUE_TAG_STR ? VAR_TYPE_STR : VAR_TYPE_INT;
+}
+
+// Whether the top of the stack 'a' and the value below it 'b' satisfy 
+// 'rule'. Instructions that pop one value pass an int for 'b'.
+bool
+operands_match(OperandRule rule, RuntimeValue a, RuntimeValue b) {
+    switch(rule) {
+        case OPERANDS_INT:  return value_type(a) == VAR_TYPE_INT && value_type(b) == VAR_TYPE_INT;
+        case OPERANDS_SAME: return value_type(a) == value_type(b);
+        default:            return true;
+    }
+}
+
 bool 
-is_str_int(const char* str) {
-    for(uint32_t i = 0; i < strlen(str); i++) {
-        if(!isdigit(str[i])) return false;
+is_str_int(StrSlice str) {
+    for(uint32_t i = 0; i < str.len; i++) {
+        if(!isdigit((unsigned char)str.data[i])) return false;
     }
     return true;
 }
 
-bool 
-is_str_literal(char* str) {
-  return (str[0] == '"' && str[strlen(str) - 1] == '"' && strlen(str) > 1);
+int32_t
+str_to_int(StrSlice str) {
+    uint32_t val = 0;
+    for(uint32_t i = 0; i < str.len; i++) {
+        val = val * 10 + (str.data[i] - '0');
+    }
+    return (int32_t)val;
 }
 
 bool 
-is_str_macro_usage(char* str) {
-    return str[0] == '$';
+is_str_macro_usage(StrSlice str) {
+    return str.data[0] == '$' && str.len > 1;
 }
 
 bool
-is_str_var_name(const char* str) {
-    if(is_str_int(str)) {
-        return false;
-    }
-    if(isdigit(str[0])) {
+is_str_var_name(StrSlice str) {
+    if(isdigit((unsigned char)str.data[0])) {
         return false;
     }
-    for(uint32_t i = 0; i < strlen(str); i++) {
-        if(str[i] == '!' || str[i] == '@' || str[i] == '#' || str[i] == '$'
-            || str[i] == '%' || str[i] == '^' || str[i] == '&' || str[i] == '*'
-            || str[i] == '(' || str[i] == ')' || str[i] == '-' || str[i] == '{'
-            || str[i] == '}' || str[i] == '[' || str[i] == ']' || str[i] == ':'
-            || str[i] == ';' || str[i] == '"' || str[i] == '\'' || str[i] == '<'
-            || str[i] == '>' || str[i] == '.' || str[i] == '/' || str[i] == '?'
-            || str[i] == '~' || str[i] == '`') {
+    for(uint32_t i = 0; i < str.len; i++) {
+        if(strchr("!@#$%^&*()-{}[]:;\"'<>./?~`", str.data[i])) {
             return false;
         }
     }
@@ -135,755 +531,4733 @@ is_str_var_name(const char* str) {
 }
 
 bool
-int_array_contains(int32_t* arr, uint32_t arr_size, int32_t val) {
-    for(uint32_t i = 0; i < arr_size; i++) {
-        if(arr[i] == val) return true;
-    }
-    return false;
+slice_equals(StrSlice slice, const char* str) {
+    return strlen(str) == slice.len && memcmp(slice.data, str, slice.len) == 0;
 }
 
-void 
-strip_char_from_str(char c, char* str) {
-    uint32_t len = strlen(str);
-    for(uint32_t i = 0; i < len; i++) {
-        if(str[i] == c) {
-            for(uint32_t j = i; j < len; j++) {
-                str[j] = str[j+1];
-            }
-            len--;
-            i--;
+void
+write_all(int fd, const char* data, size_t size) {
+    while(size > 0) {
+        ssize_t written = write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return;
         }
+        data += written;
+        size -= written;
     }
 }
 
-uint32_t
-get_word_count_in_file(FILE* file) {
-    uint32_t words_in_file = 0;
-    char ch;
-    bool on_word = false;
-    while ((ch = fgetc(file)) != EOF) {
-        if(ch == ' ' || ch == '\t' || ch == '\0' || ch == '\n') {
-            if (on_word) {
-                on_word = false;
-                words_in_file++;
-            }
-        } else {
-            on_word = true;
+void
+write_output(ProgramState* state, const char* data, size_t size) {
+    if(state->output_sink) state->output_sink(state->output_context, data, size);
+    else write_all(STDOUT_FILENO, data, size);
+}
+
+void
+flush_output(ProgramState* state) {
+    write_output(state, state->output, state->output_size);
+    state->output_size = 0;
+}
+
+// Formats an error the way PANIC_ON_ERR prints it and hands it to the
+// output sink.
+void
+sink_error(ProgramState* state, const char* name, int32_t code, const char* format, ...) {
+    char message[512];
+    int32_t len = snprintf(message, sizeof(message), "Lantern: Error: %s | Error Code: %i\n", name, code);
+    va_list args;
+    va_start(args, format);
+    len += vsnprintf(message + len, sizeof(message) - len - 1, format, args);
+    va_end(args);
+    if(len > (int32_t)sizeof(message) - 2) len = sizeof(message) - 2;
+    message[len++] = '\n';
+    state->output_sink(state->output_context, message, len);
+}
+
+void
+output_bytes(ProgramState* state, const char* data, size_t size) {
+    if(state->output_cap - state->output_size < size) {
+        flush_output(state);
+        // Too large to ever fit, so bypass the buffer.
+        if(size > state->output_cap) {
+            write_output(state, data, size);
+            return;
         }
     }
-    return words_in_file;
+    memcpy(state->output + state->output_size, data, size);
+    state->output_size += size;
 }
 
-void 
-clear_current_stackframe(ProgramState* state) {
-  for(int32_t i = state->stackframe_size; i >= 0; i--) {
-      if(state->stackframe[i].frame_index != state->stackframe_index) break;
-      state->stackframe[i].val.data = SIZE_MAX;
-      state->stackframe[i].val.heap_ptr = false; 
-      state->stackframe_size--;
-  }
-  state->stackframe_index--;
+void
+output_int(ProgramState* state, int32_t val, bool newline) {
+    // Digits are written backwards from the end, "-2147483648\n" fits.
+    char digits[12];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    if(newline) *--start = '\n';
+    uint32_t magnitude = val < 0 ? 0u - (uint32_t)val : (uint32_t)val;
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude);
+    if(val < 0) *--start = '-';
+    output_bytes(state, start, end - start);
 }
 
-void 
-heap_free(ProgramState* state, uint32_t pos) {
-    free(state->heap[pos].data);
-    state->heap_size--;
+void
+out_of_memory(ProgramState* state, size_t size) {
+    flush_output(state);
+    PANIC_ON_ERR(true, ERR_OUT_OF_MEMORY, "Cannot allocate %zu bytes with %zu bytes in use (limit: %zu).", 
+                 size, state->memory_used, state->memory_limit);
+    exit(1);
 }
 
-uint32_t 
-heap_alloc(ProgramState* state, size_t size, VariableType type) {
-    state->heap[state->heap_size].data = malloc(size);
-    state->heap[state->heap_size++].var_type = type;
-    return state->heap_size - 1; 
+// Accounts for 'size' more bytes, failing once the budget is exceeded.
+void
+charge_memory(ProgramState* state, size_t size) {
+    if(state->memory_limit && (size > state->memory_limit || state->memory_used > state->memory_limit - size))
+        out_of_memory(state, size);
+    state->memory_used += size;
+    if(state->memory_used > state->memory_peak) state->memory_peak = state->memory_used;
 }
 
-RuntimeValue
-stack_top(ProgramState* state) {
-    return state->stack[state->stack_size - 1]; 
+void*
+checked_alloc(ProgramState* state, void* ptr, size_t size) {
+    charge_memory(state, size);
+    void* allocated = realloc(ptr, size ? size : 1);
+    if(!allocated) out_of_memory(state, size);
+    return allocated;
 }
 
-RuntimeValue
-stack_pop(ProgramState* state) {
-    state->stack_size--; 
-    return state->stack[state->stack_size];
+// Grows 'arr' geometrically until it holds at least 'count' elements.
+void*
+grow_buffer(ProgramState* state, void* arr, uint32_t* cap, uint32_t count, size_t elem_size) {
+    if(count <= *cap) return arr;
+    uint32_t new_cap = *cap ? *cap : 64;
+    while(new_cap < count) new_cap *= 2;
+    state->memory_used -= (size_t)*cap * elem_size;
+    arr = checked_alloc(state, arr, (size_t)new_cap * elem_size);
+    *cap = new_cap;
+    return arr;
 }
 
-RuntimeValue
-stack_peak(ProgramState* state, uint32_t index) {
-    return state->stack[state->stack_size - index];
+// Frees a buffer that was charged 'size' bytes and gives them back.
+void
+release_buffer(ProgramState* state, void* arr, size_t size) {
+    state->memory_used -= size;
+    free(arr);
 }
 
-void 
-stack_push(ProgramState* state, RuntimeValue val) {
-    state->stack_size++;
-    state->stack[state->stack_size - 1] = val;
+// Stores 'val' in a free slot and returns its handle.
+HeapHandle
+heap_add(ProgramState* state, HeapValue val) {
+    uint32_t index;
+    if(state->free_slot_count > 0) {
+        index = state->free_slots[--state->free_slot_count];
+    } else {
+        if(state->heap_size == UINT32_MAX) out_of_memory(state, sizeof(HeapValue));
+        state->heap = grow_buffer(state, state->heap, &state->heap_cap, state->heap_size + 1, sizeof(HeapValue));
+        state->heap[state->heap_size] = (HeapValue){0};
+        index = state->heap_size++;
+    }
+    val.generation = state->heap[index].generation;
+    state->heap[index] = val;
+    return ((HeapHandle)val.generation << HANDLE_GENERATION_SHIFT) | index;
 }
 
-Token* 
-load_program_from_file(const char* filepath, uint32_t* program_size, ProgramState* state) {
-    FILE* file;
-    file = fopen(filepath, "r");
-    if(!file) {
-        printf("Lantern: [Error]: Cannot read file '%s'.\n", filepath);
-        return NULL;
+// Resolves a string or pointer value to its slot, or NULL when the handle 
+// is stale or out of range.
+HeapValue*
+heap_get(ProgramState* state, RuntimeValue val) {
+    uint32_t index = (uint32_t)val;
+    uint16_t generation = val >> HANDLE_GENERATION_SHIFT;
+    if(!value_is_heap(val) || index >= state->heap_size) return NULL;
+    // Freeing bumps the generation and retired slots end up at one no 
+    // handle was made with, so a free slot never matches.
+    HeapValue* slot = &state->heap[index];
+    return slot->generation == generation ? slot : NULL;
+}
+
+bool
+is_int_push(const Program* program, uint32_t i) {
+    return program->insts[i] == INST_STACK_PUSH && value_tag(program->operands[i]) == VALUE_TAG_INT;
+}
+
+bool
+is_int_compare(Instruction inst) {
+    return inst == INST_EQ || inst == INST_NEQ || inst == INST_GT || 
+        inst == INST_LT || inst == INST_GEQ || inst == INST_LEQ;
+}
+
+// Superinstructions read the comparison from a token that may since have
+// been quickened, so this accepts the int forms of == and != as well.
+bool
+compare_ints(Instruction inst, int32_t b, int32_t a) {
+    switch(inst) {
+        case INST_EQ:
+        case INST_EQ_INT:  return b == a;
+        case INST_NEQ:
+        case INST_NEQ_INT: return b != a;
+        case INST_GT:  return b > a;
+        case INST_LT:  return b < a;
+        case INST_GEQ: return b >= a;
+        default:       return b <= a;
     }
-    uint32_t words_in_file = get_word_count_in_file(file);
-    rewind(file);    
-
-    char literals[words_in_file][MAX_WORD_SIZE];
-    uint32_t literal_count = 0;
-    {
-        char line[MAX_WORD_SIZE];
-        bool removed_word_from_literal = false;
-        while (fgets(line, sizeof(line), file)) {
-            char literal[MAX_WORD_SIZE] = "";
-            bool on_literal = false;
-            uint32_t literal_char_count = 0;
-            for(uint32_t i = 0; i < strlen(line); i++) {
-                if(line[i] == '"' && !on_literal) {
-                    on_literal = true;
-                    literal[literal_char_count++] = line[i];
-                    continue;
-                }
-                if(on_literal) {
-                    literal[literal_char_count++] = line[i];
-                    if(line[i] == ' ' && !removed_word_from_literal) {
-                        removed_word_from_literal = true;
-                        words_in_file--;
-                    } else if(line[i] != ' ') 
-                        removed_word_from_literal = false;
-                }
-                if(line[i] == '"' && on_literal) {
-                    on_literal = false;
-                    literal[literal_char_count] = '\0';
-                    literal_char_count = 0;
-                    char literal_cpy[MAX_WORD_SIZE];
-                    strcpy(literal_cpy, literal);
-                    strcpy(literals[literal_count++], literal_cpy);
-                }
-            }
-        }
+}
+
+// b / a and b % a for a divisor other than 0. INT32_MIN / -1 wraps around 
+// to INT32_MIN, which idiv would trap on.
+int32_t
+divide_ints(Instruction inst, int32_t b, int32_t a) {
+    if(a == -1) return inst == INST_DIV ? (int32_t)(0 - (uint32_t)b) : 0;
+    return inst == INST_DIV ? b / a : b % a;
+}
+
+// Folds 'b a op' into a single push when both operands are integer 
+// constants. 'i' is the index of the first push, the result replaces it.
+bool
+fold_constants(Program* program, uint32_t i, Instruction op) {
+    if(!is_int_push(program, i) || !is_int_push(program, i + 1)) return false;
+    int32_t b = value_payload(program->operands[i]);
+    int32_t a = value_payload(program->operands[i + 1]);
+    int32_t result;
+    switch(op) {
+        case INST_PLUS:  result = (uint32_t)b + (uint32_t)a; break;
+        case INST_MINUS: result = (uint32_t)b - (uint32_t)a; break;
+        case INST_MUL:   result = (uint32_t)b * (uint32_t)a; break;
+        case INST_DIV:
+        case INST_MOD:
+            // Leave division by zero to the runtime, which reports it.
+            if(a == 0) return false;
+            result = divide_ints(op, b, a);
+            break;
+        case INST_LOGICAL_AND: result = b && a; break;
+        case INST_LOGICAL_OR:  result = b || a; break;
+        default:
+            if(!is_int_compare(op)) return false;
+            result = compare_ints(op, b, a);
+            break;
     }
-    *program_size = words_in_file;
-    rewind(file);
-    
-    Token* program = malloc(sizeof(Token) * words_in_file);
+    program->operands[i] = value_int(result);
+    return true;
+}
 
-    char word[MAX_WORD_SIZE];
-    uint32_t i = 0;
-    bool on_literal = false;
-    uint32_t literal_token_count = 0;
+void
+set_token(Program* program, uint32_t i, Instruction inst, RuntimeValue operand) {
+    program->insts[i] = inst;
+    program->operands[i] = operand;
+}
 
-    char variable_names[MAX_WORD_SIZE][STACKFRAME_CAP];
-    uint32_t variable_stackframe_indices[STACKFRAME_CAP];
-    uint32_t variable_count = 0;
-    uint32_t virtual_stackframe_index = 0;
-    
-    uint32_t crossreferenced_tokens[*program_size];
-    uint32_t crossreferenced_token_count = 0;
+// Makes room for 'count' tokens plus the INST_HALT sentinel that 
+// terminates exec_program.
+void
+reserve_program(ProgramState* state, Program* program, uint32_t count) {
+    if(count < program->cap) return;
+    uint32_t cap = program->cap;
+    if(program->positions) 
+        program->positions = grow_buffer(state, program->positions, &cap, count + 1, sizeof(TokenPos));
+    cap = program->cap;
+    program->operands = grow_buffer(state, program->operands, &cap, count + 1, sizeof(RuntimeValue));
+    program->insts = grow_buffer(state, program->insts, &program->cap, count + 1, sizeof(uint8_t));
+}
 
-    bool on_comment = false;
+void
+free_program(Program* program) {
+    free(program->insts);
+    free(program->operands);
+    free(program->positions);
+    for(uint32_t i = 0; i < program->macro_call_count; i++) {
+        free(program->macro_calls[i].name);
+    }
+    free(program->macro_calls);
+}
 
-    char macro_names[MAX_WORD_SIZE][PROGRAM_CAP];
-    uint32_t macro_names_count = 0;
-    while(fscanf(file, "%s", word) != EOF) {
-        //printf("%s\n", word);
-        if(strcmp("#", word) == 0 && !on_comment) {
-            on_comment = true;
-        } else if(strcmp("#>", word) == 0 && on_comment) {
-            on_comment = false;
-            continue;
-        }
-        if(on_comment) continue;
+// FNV-1a, which can be continued from the hash of a prefix.
+#define HASH_SEED 14695981039346656037ULL
 
-        if((!on_literal && word[0] == '"') || (!on_literal && is_str_literal(word))) {
-            on_literal = !is_str_literal(word);
+uint64_t
+hash_bytes_from(uint64_t hash, const void* data, size_t size) {
+    for(size_t i = 0; i < size; i++) {
+        hash ^= ((const uint8_t*)data)[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-            char* literal_cpy = malloc(MAX_WORD_SIZE);
-            strcpy(literal_cpy, literals[literal_token_count]);
-            strip_char_from_str('"', literal_cpy);
+uint64_t
+hash_bytes(const void* data, size_t size) {
+    return hash_bytes_from(HASH_SEED, data, size);
+}
 
-            state->heap[state->heap_size].data = literal_cpy;
-            state->heap[state->heap_size].var_type = VAR_TYPE_STR;
-            program[i] = (Token){ .inst = INST_STACK_PUSH };
-            program[i].val.data = state->heap_size;
-            program[i].val.var_type = VAR_TYPE_STR;
-            program[i].val.heap_ptr = true;
+// The element type a type word allocates, 'int' being 64 bits wide.
+ElementType
+element_type(StrSlice word) {
+    if(slice_equals(word, "i8")) return ELEM_I8;
+    if(slice_equals(word, "i16")) return ELEM_I16;
+    if(slice_equals(word, "i32")) return ELEM_I32;
+    if(slice_equals(word, "str")) return ELEM_STR;
+    return ELEM_I64;
+}
 
-            state->heap_size++;
-            literal_token_count++;
-            i++;
-            continue;
-        }
-        if(on_literal && word[strlen(word) - 1] == '"') {
-            on_literal = false;
-            continue;
-        }
-        if(on_literal) {
-            continue;
-        }
-        if(is_str_int(word)) {
-            program[i] = (Token){ .inst = INST_STACK_PUSH };
-            program[i].val.data = atoi(word);
-            program[i].val.var_type = VAR_TYPE_INT;
-            program[i].val.heap_ptr = false;
-            i++;
-            continue;
-        }
-        if(is_str_macro_usage(word)) {
-            memmove(word, word+1, strlen(word));
-            for(uint32_t j = 0; j < macro_names_count; j++) {
-                if(strcmp(macro_names[j], word) == 0) {
-                    program[i] = (Token){ .inst = INST_MACRO_USAGE, .val.data = state->macro_positions[j] };
-                    break;
-                }
-            }
-            i++;
-            continue;
-        }
-        
-        if(i > 0) {
-            if(program[i - 1].inst == INST_MACRO) {
-                strcpy(macro_names[macro_names_count++], word);
-                i++;
-                continue;
-            }
-        }
-        if(strcmp(word, "prev") == 0) {
-            program[i] = (Token){ .inst = INST_STACK_PREV };
-        } else if(strcmp(word, "=") == 0) {
-            program[i] = (Token){ .inst = INST_ASSIGN };
-        } else if(strcmp(word, "+") == 0) {
-            program[i] = (Token){ .inst = INST_PLUS };
-        } else if(strcmp(word, "-") == 0) {
-            program[i] = (Token){ .inst = INST_MINUS };
-        } else if(strcmp(word, "*") == 0) {
-            program[i] = (Token){ .inst = INST_MUL };
-        } else if(strcmp(word, "%") == 0) {
-            program[i] = (Token){ .inst = INST_MOD };
-        } else if(strcmp(word, "/") == 0) {
-            program[i] = (Token){ .inst = INST_MUL };
-        } else if(strcmp(word, "==") == 0) {
-            program[i] = (Token){ .inst = INST_EQ };
-        } else if(strcmp(word, "!=") == 0) {
-            program[i] = (Token){ .inst = INST_NEQ };
-        } else if(strcmp(word, ">") == 0) {
-            program[i] = (Token){ .inst = INST_GT };
-        } else if(strcmp(word, "<") == 0) {
-            program[i] = (Token){ .inst = INST_LT };
-        } else if(strcmp(word, ">=") == 0) {
-            program[i] = (Token){ .inst = INST_GEQ };
-        } else if(strcmp(word, "<=") == 0) {
-            program[i] = (Token){ .inst = INST_LEQ };
-        } else if(strcmp(word, "and") == 0) {
-            program[i] = (Token){ .inst = INST_LOGICAL_AND };
-        } else if(strcmp(word, "or") == 0) {
-            program[i] = (Token){ .inst = INST_LOGICAL_OR };
-        } else if(strcmp(word, "if") == 0) {
-            virtual_stackframe_index++;
-            program[i] = (Token){ .inst = INST_IF };
-        } else if(strcmp(word, "else") == 0) {
-            program[i] = (Token){ .inst = INST_ELSE };
-        } else if(strcmp(word, "end") == 0) {
-            for(int32_t j = i; j >= 0; j--) {
-                bool skip_token = false;
-                for(uint32_t k = 0; k < crossreferenced_token_count; k++) {
-                    if(crossreferenced_tokens[k] != (uint32_t)j) continue;
-                    skip_token = true;
-                    break;
-                }
-                if(skip_token) continue;
+bool
+lookup_keyword(StrSlice word, Instruction* inst) {
+    // Branching on the first character leaves at most five candidates per 
+    // word, which makes this a flattened trie over the keyword set. 'end' 
+    // maps to INST_ENDIF until the loader knows which block it closes.
+#define KEYWORD(str, instruction) if(slice_equals(word, str)) { *inst = instruction; return true; }
+    switch(word.data[0]) {
+        case '=': KEYWORD("=", INST_ASSIGN); KEYWORD("==", INST_EQ); break;
+        case '!': KEYWORD("!=", INST_NEQ); break;
+        case '+': KEYWORD("+", INST_PLUS); break;
+        case '-': KEYWORD("-", INST_MINUS); break;
+        case '*': KEYWORD("*", INST_MUL); break;
+        case '/': KEYWORD("/", INST_DIV); break;
+        case '%': KEYWORD("%", INST_MOD); break;
+        case '>': KEYWORD(">", INST_GT); KEYWORD(">=", INST_GEQ); break;
+        case '<': KEYWORD("<", INST_LT); KEYWORD("<=", INST_LEQ); break;
+        case 'a': KEYWORD("and", INST_LOGICAL_AND); KEYWORD("alloc", INST_HEAP_ALLOC); break;
+        case 'c': KEYWORD("copy", INST_COPY); KEYWORD("compare", INST_COMPARE); break;
+        case 'e': KEYWORD("end", INST_ENDIF); KEYWORD("else", INST_ELSE); KEYWORD("elif", INST_ELIF); break;
+        case 'f': KEYWORD("free", INST_HEAP_FREE); KEYWORD("fill", INST_FILL); break;
+        case 'i': 
+            KEYWORD("if", INST_IF); KEYWORD("int", INST_INT_TYPE); KEYWORD("i8", INST_INT_TYPE); 
+            KEYWORD("i16", INST_INT_TYPE); KEYWORD("i32", INST_INT_TYPE); KEYWORD("i64", INST_INT_TYPE); 
+            break;
+        case 'j': KEYWORD("jmp", INST_JUMP); break;
+        case 'm': KEYWORD("min", INST_MIN); KEYWORD("max", INST_MAX); break;
+        case 'o': KEYWORD("or", INST_LOGICAL_OR); break;
+        case 'p': 
+            KEYWORD("print", INST_PRINT); KEYWORD("println", INST_PRINTLN); KEYWORD("prev", INST_STACK_PREV);
+            KEYWORD("pget", INST_PTR_GET_I); KEYWORD("pset", INST_PTR_SET_I); KEYWORD("pwhile", INST_PWHILE);
+            break;
+        case 'r': KEYWORD("run", INST_RUN_WHILE); break;
+        case 's': KEYWORD("str", INST_STR_TYPE); KEYWORD("sum", INST_SUM); KEYWORD("sort", INST_SORT); break;
+        case 't': KEYWORD("then", INST_THEN); break;
+        case 'w': KEYWORD("while", INST_WHILE); break;
+        default: break;
+    }
+#undef KEYWORD
+    return false;
+}
 
-                if(program[j].inst == INST_IF) {
-                    program[i] = (Token) { .inst = INST_ENDIF };
-                    virtual_stackframe_index--;
-                    crossreferenced_tokens[crossreferenced_token_count++] = j;
-                    break;
-                } else if(program[j].inst == INST_WHILE) {
-                    program[i] = (Token){ .inst = INST_END_WHILE };
-                    program[i].val.data = j;
-                    virtual_stackframe_index--;
-                    crossreferenced_tokens[crossreferenced_token_count++] = j;
-                    break;
-                } else if(program[j].inst == INST_MACRO) {
-                    program[i] = (Token){ .inst = INST_END_MACRO };
-                    crossreferenced_tokens[crossreferenced_token_count++] = j;
-                    break;
-                }
-            } 
-        } else if(strcmp(word, "then") == 0) {
-            program[i] = (Token){ .inst = INST_THEN };
-        }else if(strcmp(word, "elif") == 0) {
-            program[i] = (Token){ .inst = INST_ELIF };
-        } else if(strcmp(word, "print") == 0) {
-            program[i] = (Token){ .inst = INST_PRINT };
-        } else if(strcmp(word, "while") == 0) {
-            program[i] = (Token){ .inst = INST_WHILE };
-        } else if(strcmp(word, "run") == 0) {
-            virtual_stackframe_index++;
-            program[i] = (Token){ .inst = INST_RUN_WHILE };
-        } else if(strcmp(word, "println") == 0) {
-            program[i] = (Token){ .inst = INST_PRINTLN };
-        } else if(strcmp(word, "jmp") == 0) {
-            program[i] = (Token){ .inst = INST_JUMP };
-        } else if(strcmp(word, "alloc") == 0) {
-            program[i] = (Token){ .inst = INST_HEAP_ALLOC };
-        } else if(strcmp(word, "free") == 0) {
-            program[i] = (Token){ .inst = INST_HEAP_FREE };
-        } else if(strcmp(word, "pget") == 0) {
-            program[i] = (Token){ .inst = INST_PTR_GET_I };
-        } else if(strcmp(word, "pset") == 0) {
-            program[i] = (Token){ .inst = INST_PTR_SET_I };
-        } else if(strcmp(word, "int") == 0) {
-            program[i] = (Token){ .inst = INST_INT_TYPE };
-        } else if(strcmp(word, "str") == 0) {
-            program[i] = (Token){ .inst = INST_STR_TYPE };
-        } else if(strcmp(word, "macro") == 0) {
-            program[i] = (Token){ .inst = INST_MACRO };
-        } else if(strcmp(word, "def") == 0) {
-            program[i] = (Token){ .inst = INST_MACRO_DEF };
-            state->macro_positions[state->macro_count++] = i;
-        } else {
-            if(is_str_var_name(word)) {
-                if(program[i - 1].inst == INST_ASSIGN) {
-                    PANIC_ON_ERR(i < 2, ERR_SYNTAX_ERROR, "Assigning variable to nothing."); 
-                    bool re_assigning = false;
-                    for(uint32_t j = 0; j < variable_count; j++) {
-                        if(strcmp(variable_names[j], word) == 0) {
-                            int32_t stackframe_index = -1;
-                            for(uint32_t k = 0; k < variable_count; k++) {
-                                if(strcmp(variable_names[k], word) != 0) continue;
-                                stackframe_index = k;
-                                break; 
-                            }
-                            re_assigning = true;
-                            program[i] = (Token){ .inst = INST_VAR_REASSIGN };
-                            program[i].val.data = stackframe_index;
-                            break;
-                        }    
-                    }
-                    if(!re_assigning) {
-                        strcpy(variable_names[variable_count], word);
-                        variable_stackframe_indices[variable_count++] = virtual_stackframe_index;
-                        program[i] = (Token){ .inst = INST_ADD_VAR_TO_STACKFRAME};
-                    }
-                    i++;
-                    continue;
-                } 
-                int32_t stackframe_index = -1;
-                for(uint32_t i = 0; i < variable_count; i++) {
-                    if(strcmp(variable_names[i], word) != 0 || variable_stackframe_indices[i] > virtual_stackframe_index) continue;
-                    stackframe_index = i;
-                    break;
-                }
-                PANIC_ON_ERR(stackframe_index == -1, ERR_SYNTAX_ERROR, "Undeclared identifier '%s'.", word);
-                program[i] = (Token){ .inst = INST_VAR_USAGE };
-                program[i].val.data = stackframe_index;
-                i++;
-                continue;
-            
-            }
-            PANIC_ON_ERR(true, ERR_SYNTAX_ERROR, "Syntax Error: Invalid Token '%s'.", word);
+uint32_t
+intern_symbol(ProgramState* state, SymbolTable* table, StrSlice name) {
+    if(table->symbol_count * 2 >= table->bucket_count) {
+        // Keep the load factor at or below one half.
+        release_buffer(state, table->buckets, sizeof(uint32_t) * table->bucket_count);
+        table->bucket_count = table->bucket_count ? table->bucket_count * 2 : 256;
+        size_t size = sizeof(uint32_t) * table->bucket_count;
+        table->buckets = memset(checked_alloc(state, NULL, size), 0, size);
+        for(uint32_t i = 0; i < table->symbol_count; i++) {
+            uint32_t bucket = table->symbols[i].hash & (table->bucket_count - 1);
+            while(table->buckets[bucket]) bucket = (bucket + 1) & (table->bucket_count - 1);
+            table->buckets[bucket] = i + 1;
+        }
+    }
+    uint32_t hash = (uint32_t)hash_bytes(name.data, name.len);
+    uint32_t bucket = hash & (table->bucket_count - 1);
+    while(table->buckets[bucket]) {
+        Symbol* symbol = &table->symbols[table->buckets[bucket] - 1];
+        if(symbol->hash == hash && symbol->name.len == name.len && 
+           memcmp(symbol->name.data, name.data, name.len) == 0) {
+            return table->buckets[bucket] - 1;
         }
-        i++;
+        bucket = (bucket + 1) & (table->bucket_count - 1);
     }
-    rewind(file);
-    fclose(file); 
+    GROW_BUFFER(state, table->symbols, table->symbol_count, table->symbol_cap);
+    table->symbols[table->symbol_count] = (Symbol){ .name = name, .hash = hash, .var_slot = SYMBOL_NONE };
+    table->buckets[bucket] = table->symbol_count + 1;
+    return table->symbol_count++;
+}
 
-    return program;
+void
+free_symbol_table(ProgramState* state, SymbolTable* table) {
+    release_buffer(state, table->symbols, sizeof(Symbol) * table->symbol_cap);
+    release_buffer(state, table->buckets, sizeof(uint32_t) * table->bucket_count);
 }
 
 void
-crossreference_tokens(Token* program, uint32_t program_size) {
-    uint32_t crossreferenced_whiles[program_size];
-    uint32_t crossreferenced_whiles_count = 0;
-    for(uint32_t i = 0; i < program_size; i++) {
-        if(program[i].inst == INST_RUN_WHILE) {
-            if(int_array_contains((int32_t*)crossreferenced_whiles, crossreferenced_whiles_count, i))
-                continue;
-            uint32_t while_index = 0;
-            uint32_t end_while_index = 0;
-            while_index++;
-            for(uint32_t j = i + 1; j < program_size; j++) {
-                if(program[j].inst == INST_END_WHILE && (while_index - 1) == end_while_index) {
-                    program[i].val.data = j;
-                    crossreferenced_whiles[crossreferenced_whiles_count++] = j;
-                    break;
-                } else if(program[j].inst == INST_END_WHILE && (while_index - 1) != end_while_index) {
-                    end_while_index++;
-                }
-                if(program[j].inst == INST_RUN_WHILE) {
-                    while_index++;
-                }
-            }
-        }
-        if(program[i].inst == INST_ELSE) {
-            for(uint32_t j = i; j < program_size; j++) {
-                if(program[j].inst != INST_ENDIF) continue;
-                program[i].val.data = j; 
-                break;
-            }     
-        }
-        if(program[i].inst == INST_IF || program[i].inst == INST_THEN) {
-            program[i].val.data = -1;
-            for(uint32_t j = i; j < program_size; j++) {
-                if(program[j].inst != INST_ELIF) continue;
-                program[i].val.data = j - 1;
-                break;
-            }
-            if(program[i].val.data == (size_t)-1) {
-                for(uint32_t j = i; j < program_size; j++) {
-                    if(program[j].inst != INST_ELSE) continue;
-                    program[i].val.data = j;
-                    break;
-                }
-            }
-            if(program[i].val.data == (size_t)-1) {
-                for(uint32_t j = i; j < program_size; j++) {
-                    if(program[j].inst != INST_ENDIF) continue;
-                    program[i].val.data = j;
-                    break;
-                }
-            }
-            PANIC_ON_ERR(program[i].val.data == (size_t)-1, ERR_SYNTAX_ERROR, "If without endif");
-        }
-        if(program[i].inst == INST_MACRO) {
-            for(uint32_t j = i; j < program_size; j++) {
-                if(program[j].inst != INST_END_MACRO) continue;
-                program[i].val.data = j;
-                break;
-            }
+pop_scope_variables(SymbolTable* symbols, ScopeVariable* scope_vars, uint32_t* scope_var_count, uint32_t depth) {
+    while(*scope_var_count > 0 && scope_vars[*scope_var_count - 1].depth > depth) {
+        symbols->symbols[scope_vars[--(*scope_var_count)].symbol].var_slot = SYMBOL_NONE;
+    }
+}
+
+// Reads the next whitespace separated word. With 'literals' set, a word 
+// that starts with a quote runs up to the closing quote instead, so string
+// literals may contain whitespace.
+bool
+next_word(Lexer* lexer, StrSlice* word, bool literals) {
+    while(lexer->pos < lexer->size && isspace((unsigned char)lexer->src[lexer->pos])) lexer->pos++;
+    if(lexer->pos >= lexer->size) return false;
+
+    word->data = lexer->src + lexer->pos;
+    if(literals && word->data[0] == '"') {
+        const char* literal_end = memchr(word->data + 1, '"', lexer->size - lexer->pos - 1);
+        lexer->pos = literal_end ? (size_t)(literal_end + 1 - lexer->src) : lexer->size;
+    } else {
+        while(lexer->pos < lexer->size && !isspace((unsigned char)lexer->src[lexer->pos])) lexer->pos++;
+    }
+    word->len = (lexer->src + lexer->pos) - word->data;
+    return true;
+}
+
+// Reads the body of a macro whose 'def' was just consumed: everything up to
+// the 'end' that balances it.
+bool
+scan_macro_body(Lexer* lexer, StrSlice* body) {
+    body->data = lexer->src + lexer->pos;
+    uint32_t depth = 1;
+    bool on_comment = false;
+    StrSlice word;
+    while(next_word(lexer, &word, !on_comment)) {
+        if(on_comment) {
+            on_comment = !slice_equals(word, "#>");
+        } else if(slice_equals(word, "#")) {
+            on_comment = true;
+        } else if(slice_equals(word, "if") || slice_equals(word, "while") || slice_equals(word, "pwhile") ||
+                  slice_equals(word, "macro")) {
+            depth++;
+        } else if(slice_equals(word, "end") && --depth == 0) {
+            body->len = word.data - body->data;
+            return true;
         }
     }
+    return false;
+}
+
+bool
+map_file(const char* filepath, MappedFile* file) {
+#ifdef _WIN32
+    FILE* f = fopen(filepath, "rb");
+    if(!f) return false;
+    fseek(f, 0, SEEK_END);
+    file->size = ftell(f);
+    rewind(f);
+    file->data = malloc(file->size + 1);
+    bool ok = fread(file->data, 1, file->size, f) == file->size;
+    fclose(f);
+    if(!ok) free(file->data);
+    return ok;
+#else
+    int fd = open(filepath, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    file->size = st.st_size;
+    file->data = file->size ? mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    return file->data != MAP_FAILED;
+#endif
+}
+
+void
+unmap_file(MappedFile* file) {
+#ifdef _WIN32
+    free(file->data);
+#else
+    if(file->size) munmap(file->data, file->size);
+#endif
+    file->data = NULL;
+    file->size = 0;
 }
+
 void 
-exec_program(ProgramState* state, Token* program, uint32_t program_size) {
-    crossreference_tokens(program, program_size);
-    while(state->inst_ptr < program_size) {
-        //printf("instruction: %i\n", state->inst_ptr);
-        Token* current_token = &program[state->inst_ptr];
-        if(current_token->inst == INST_RUN_WHILE) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "No value for while condition specified.");
-            PANIC_ON_ERR(stack_top(state).var_type != VAR_TYPE_INT, ERR_INVALID_DATA_TYPE,
-                "Invalid data type for while condition.");
-
-            int32_t cond = stack_pop(state).data;
-            if(!cond) 
-                state->inst_ptr = current_token->val.data;
-            else 
-                state->stackframe_index++;
-        }
-        if(current_token->inst == INST_END_WHILE) {
-            uint32_t while_index = current_token->val.data;
-            state->inst_ptr = while_index;
-            clear_current_stackframe(state);
-        } 
-        if(current_token->inst == INST_VAR_USAGE) {
-            state->stack[state->stack_size++] = state->stackframe[current_token->val.data].val;
-        }
-        if(current_token->inst == INST_ADD_VAR_TO_STACKFRAME) {
-            state->stackframe[state->stackframe_size] = (StackFrameValue){ .frame_index = state->stackframe_index };
-            state->stackframe[state->stackframe_size++].val = stack_pop(state);
-        }
-        if(current_token->inst == INST_VAR_REASSIGN) {
-            state->stackframe[current_token->val.data].val = stack_pop(state);
-        }
-        if (current_token->inst == INST_STACK_PUSH) {
-            PANIC_ON_ERR(state->stack_size >= STACK_CAP, ERR_STACK_OVERFLOW, "Stack is overflowed");
-            stack_push(state, current_token->val);
-        }
-        if(current_token->inst == INST_PLUS || current_token->inst == INST_MINUS ||
-            current_token->inst == INST_DIV || current_token->inst == INST_MUL || 
-            current_token->inst == INST_MOD) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW,
-                         "Too few values on stack for arithmetic operator.");
-            
-            RuntimeValue val_a = stack_peak(state, 1);
-            RuntimeValue val_b = stack_peak(state, 2);
-            if(val_a.var_type == VAR_TYPE_INT && val_b.var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                if (current_token->inst == INST_PLUS)
-                    state->stack[state->stack_size].data = b + a;
-                else if (current_token->inst == INST_MINUS)
-                    state->stack[state->stack_size].data = b - a;
-                else if (current_token->inst == INST_MUL)
-                    state->stack[state->stack_size].data = b * a;
-                else if (current_token->inst == INST_DIV)
-                    state->stack[state->stack_size].data = b / a;
-                else if(current_token->inst == INST_MOD)
-                    state->stack[state->stack_size].data = b % a;
-                state->stack[state->stack_size++].var_type = VAR_TYPE_INT;
-            } else if(val_a.var_type == VAR_TYPE_STR && val_b.var_type == VAR_TYPE_STR) {
-                if(current_token->inst == INST_PLUS) {
-                    char* a = state->heap[stack_pop(state).data].data;
-                    char* b = state->heap[stack_pop(state).data].data;
-                    state->heap[state->heap_size].data = strcat(b, a);
-                    state->heap[state->heap_size].var_type = VAR_TYPE_STR;
-                    stack_push(state, (RuntimeValue) { .heap_ptr = true, .data = state->heap_size, .var_type = VAR_TYPE_STR });
-                    state->heap_size++;
-                }
-            }
-        }
-        if(current_token->inst == INST_PRINT || current_token->inst == INST_PRINTLN) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "No value for print function on stack.");
-            bool heap_ptr = stack_top(state).heap_ptr;
-            if(!heap_ptr) {
-                int32_t val = stack_pop(state).data;
-                if(current_token->inst == INST_PRINTLN)
-                    printf("%i\n", val);
-                else
-                    printf("%i", val);
-            } else { 
-                if(state->heap[stack_top(state).data].var_type == VAR_TYPE_STR) {
-                    char* val = state->heap[stack_pop(state).data].data;
-                    if(current_token->inst == INST_PRINTLN)
-                        printf("%s\n", val);
-                    else
-                        printf("%s", val);
-                }
-            }
+clear_current_stackframe(ProgramState* state) {
+  for(int32_t i = state->stackframe_size - 1; i >= 0; i--) {
+      if(state->stackframe_depths[i] != state->stackframe_index) break;
+      state->stackframe_size--;
+  }
+  state->stackframe_index--;
+}
+
+uint32_t
+pool_class(size_t size) {
+    uint32_t size_class = 0;
+    while((size_t)POOL_MIN_SIZE << size_class < size) size_class++;
+    return size_class;
+}
+
+char*
+new_slab(ProgramState* state, size_t size) {
+    char* slab = checked_alloc(state, NULL, size);
+    state->slabs = grow_buffer(state, state->slabs, &state->slab_cap, state->slab_count + 1, sizeof(void*));
+    state->slabs[state->slab_count++] = slab;
+    return slab;
+}
+
+void*
+pool_alloc(ProgramState* state, uint32_t size_class) {
+    if(!state->pools[size_class]) {
+        char* slab = new_slab(state, POOL_SLAB_SIZE);
+        size_t block_size = POOL_MIN_SIZE << size_class;
+        for(size_t offset = POOL_SLAB_SIZE; offset >= block_size; offset -= block_size) {
+            PoolBlock* block = (PoolBlock*)(slab + offset - block_size);
+            block->next = state->pools[size_class];
+            state->pools[size_class] = block;
         }
-        if(current_token->inst == INST_JUMP) {
-            int32_t index = stack_pop(state).data;
-            PANIC_ON_ERR(index >= (int32_t)program_size || 
-                         index < 0, ERR_INVALID_JUMP, "Invalid index for jump specified.");
-            state->inst_ptr = index;
-            continue;
+    }
+    PoolBlock* block = state->pools[size_class];
+    state->pools[size_class] = block->next;
+    return block;
+}
+
+void
+pool_free(ProgramState* state, void* data, uint32_t size_class) {
+    PoolBlock* block = data;
+    block->next = state->pools[size_class];
+    state->pools[size_class] = block;
+}
+
+// Makes a slot free for reuse, which turns the handles to it stale.
+void
+retire_slot(ProgramState* state, HeapValue* slot) {
+    slot->kind = HEAP_SLOT_FREE;
+    slot->data = NULL;
+    if(++slot->generation == HANDLE_GENERATION_MAX) return;
+    state->free_slots = grow_buffer(state, state->free_slots, &state->free_slot_cap, 
+                                    state->free_slot_count + 1, sizeof(uint32_t));
+    state->free_slots[state->free_slot_count++] = slot - state->heap;
+}
+
+void 
+heap_free(ProgramState* state, HeapValue* slot) {
+    if(slot->size <= POOL_MAX_SIZE) {
+        pool_free(state, slot->data, pool_class(slot->size));
+    } else {
+        free(slot->data);
+        state->memory_used -= slot->size;
+    }
+    retire_slot(state, slot);
+}
+
+uint32_t
+elem_width(ElementType type) {
+    return type == ELEM_STR ? sizeof(RuntimeValue) : 1u << type;
+}
+
+VariableType
+elem_var_type(ElementType type) {
+    return type == ELEM_STR ? VAR_TYPE_STR : VAR_TYPE_INT;
+}
+
+uint32_t
+block_length(const HeapValue* block) {
+    return block->size / elem_width(block->elem_type);
+}
+
+void*
+block_data_alloc(ProgramState* state, size_t size) {
+    if(size <= POOL_MAX_SIZE) return pool_alloc(state, pool_class(size));
+    return checked_alloc(state, NULL, size);
+}
+
+HeapHandle 
+heap_alloc(ProgramState* state, uint32_t length, ElementType type) {
+    uint64_t size = (uint64_t)length * elem_width(type);
+    if(size > UINT32_MAX) out_of_memory(state, size);
+    HeapValue slot = { .data = block_data_alloc(state, size), .size = size, 
+                       .elem_type = type, .kind = HEAP_SLOT_BLOCK };
+    return heap_add(state, slot);
+}
+
+int32_t
+block_get_int(const HeapValue* block, uint32_t index) {
+    switch(block->elem_type) {
+        case ELEM_I8:  return ((const int8_t*)block->data)[index];
+        case ELEM_I16: return ((const int16_t*)block->data)[index];
+        case ELEM_I32: return ((const int32_t*)block->data)[index];
+        default:       return (int32_t)((const int64_t*)block->data)[index];
+    }
+}
+
+void
+block_set_int(HeapValue* block, uint32_t index, int32_t val) {
+    switch(block->elem_type) {
+        case ELEM_I8:  ((int8_t*)block->data)[index] = (int8_t)val; break;
+        case ELEM_I16: ((int16_t*)block->data)[index] = (int16_t)val; break;
+        case ELEM_I32: ((int32_t*)block->data)[index] = val; break;
+        default:       ((int64_t*)block->data)[index] = val; break;
+    }
+}
+
+// Writes an int or a string to the output, returns false for a freed value.
+// Blocks print nothing.
+bool
+print_value(ProgramState* state, RuntimeValue val, bool newline) {
+    if(!value_is_heap(val)) {
+        output_int(state, value_payload(val), newline);
+    } else {
+        HeapValue* slot = heap_get(state, val);
+        if(!slot) return false;
+        if(slot->kind != HEAP_SLOT_BLOCK) {
+            const String* str = slot->data;
+            output_bytes(state, str->data, str->len);
+            if(newline) output_bytes(state, "\n", 1);
         }
-        if(current_token->inst == INST_STACK_PREV) {
-            state->stack_size--;
-            int32_t index = (state->stack_size - 1) - current_token->val.data;
-            PANIC_ON_ERR(index >= (int32_t)state->stack_size || 
-                         index < 0, ERR_INVALID_STACK_ACCESS, "Invalid index for retrieving value from stack");
-            stack_push(state, state->stack[index]);
-        }
-        if(current_token->inst == INST_EQ) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for equality check specified.");
-            
-            RuntimeValue val_a = stack_peak(state, 1);
-            RuntimeValue val_b = stack_peak(state, 2);
-            if(val_a.var_type == VAR_TYPE_INT && val_b.var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(a == b), .var_type = VAR_TYPE_INT });
-            } else if(val_a.var_type == VAR_TYPE_STR && val_b.var_type == VAR_TYPE_STR) {
-                char* a = state->heap[stack_pop(state).data].data;
-                char* b = state->heap[stack_pop(state).data].data;
-                stack_push(state, (RuntimeValue){ .data = strcmp(a, b) == 0, .var_type = VAR_TYPE_INT });
-            }
+    }
+    if(newline && state->line_buffered) flush_output(state);
+    return true;
+}
+
+void*
+arena_alloc(ProgramState* state, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if(state->arena_used + size > state->arena_cap) {
+        state->arena_cap = size > POOL_SLAB_SIZE ? size : POOL_SLAB_SIZE;
+        state->arena = new_slab(state, state->arena_cap);
+        state->arena_used = 0;
+    }
+    void* data = state->arena + state->arena_used;
+    state->arena_used += size;
+    return data;
+}
+
+// Rebuilds the intern table from the string slots on the heap, which drops
+// the strings a collection freed.
+void
+rebuild_string_table(ProgramState* state, uint32_t bucket_count) {
+    free(state->string_buckets);
+    state->string_buckets = calloc(bucket_count, sizeof(uint32_t));
+    if(!state->string_buckets) out_of_memory(state, sizeof(uint32_t) * bucket_count);
+    state->string_bucket_count = bucket_count;
+    state->string_count = 0;
+    for(uint32_t i = 0; i < state->heap_size; i++) {
+        HeapValue* slot = &state->heap[i];
+        if(slot->kind != HEAP_SLOT_STRING && slot->kind != HEAP_SLOT_LITERAL) continue;
+        const String* str = slot->data;
+        uint32_t bucket = str->hash & (bucket_count - 1);
+        while(state->string_buckets[bucket]) bucket = (bucket + 1) & (bucket_count - 1);
+        state->string_buckets[bucket] = i + 1;
+        state->string_count++;
+    }
+}
+
+// Returns the handle of the string 'head' followed by 'tail', creating it
+// when no such string is alive. 'hash' is the hash of 'head', so only the
+// tail has to be hashed and nothing is copied unless the string is new.
+HeapHandle
+intern_string(ProgramState* state, StrSlice head, uint64_t hash, StrSlice tail, HeapSlotKind kind) {
+    if(state->string_count * 2 >= state->string_bucket_count) {
+        // Keep the load factor at or below one half.
+        rebuild_string_table(state, state->string_bucket_count ? state->string_bucket_count * 2 : 256);
+    }
+    if((uint64_t)head.len + tail.len >= UINT32_MAX) out_of_memory(state, (uint64_t)head.len + tail.len);
+    uint32_t len = head.len + tail.len;
+    hash = hash_bytes_from(hash, tail.data, tail.len);
+    uint32_t bucket = (uint32_t)hash & (state->string_bucket_count - 1);
+    while(state->string_buckets[bucket]) {
+        uint32_t index = state->string_buckets[bucket] - 1;
+        const String* str = state->heap[index].data;
+        if(str->hash == hash && str->len == len && memcmp(str->data, head.data, head.len) == 0 &&
+           memcmp(str->data + head.len, tail.data, tail.len) == 0) {
+            return ((HeapHandle)state->heap[index].generation << HANDLE_GENERATION_SHIFT) | index;
         }
-        if(current_token->inst == INST_NEQ) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for equality check specified.");
-            RuntimeValue val_a = stack_peak(state, 1);
-            RuntimeValue val_b = stack_peak(state, 2);
-            if(val_a.var_type == VAR_TYPE_INT && val_b.var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(a != b), .var_type = VAR_TYPE_INT });
-            } else if(val_a.var_type == VAR_TYPE_STR && val_b.var_type == VAR_TYPE_STR) {
-                char* a = state->heap[stack_pop(state).data].data;
-                char* b = state->heap[stack_pop(state).data].data;
-                stack_push(state, (RuntimeValue){ .data = strcmp(a, b) != 0, .var_type = VAR_TYPE_INT });
-            }
+        bucket = (bucket + 1) & (state->string_bucket_count - 1);
+    }
+    size_t size = sizeof(String) + len + 1;
+    HeapValue slot = { .size = size, .elem_type = ELEM_STR, .kind = kind };
+    if(kind == HEAP_SLOT_LITERAL) {
+        slot.data = arena_alloc(state, size);
+    } else {
+        slot.data = block_data_alloc(state, size);
+        state->gc_allocated += size;
+    }
+    String* str = slot.data;
+    str->hash = hash;
+    str->len = len;
+    memcpy(str->data, head.data, head.len);
+    memcpy(str->data + head.len, tail.data, tail.len);
+    str->data[len] = '\0';
+    HeapHandle handle = heap_add(state, slot);
+    state->string_buckets[bucket] = (uint32_t)handle + 1;
+    state->string_count++;
+    return handle;
+}
+
+HeapHandle
+register_literal(ProgramState* state, const char* data, size_t len) {
+    return intern_string(state, (StrSlice){ "", 0 }, HASH_SEED, (StrSlice){ data, len }, HEAP_SLOT_LITERAL);
+}
+
+HeapHandle
+concat_strings(ProgramState* state, const String* b, const String* a) {
+    return intern_string(state, (StrSlice){ b->data, b->len }, b->hash, 
+                         (StrSlice){ a->data, a->len }, HEAP_SLOT_STRING);
+}
+
+void
+mark_value(ProgramState* state, bool* marked, RuntimeValue val) {
+    if(value_tag(val) != VALUE_TAG_STR) return;
+    HeapValue* slot = heap_get(state, val);
+    if(slot) marked[slot - state->heap] = true;
+}
+
+uint64_t
+now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The time stamp counter where there is one, nanoseconds elsewhere.
+uint64_t
+read_cycles(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+// Frees every runtime string that is no longer reachable from the operand 
+// stack, the variables in scope or a block of strings. Literals are never
+// collected. The stack has to be written back to the state beforehand.
+void
+collect_garbage(ProgramState* state) {
+    uint64_t start = now_ns();
+    bool* marked = calloc(state->heap_size, sizeof(bool));
+    if(!marked && state->heap_size) out_of_memory(state, sizeof(bool) * state->heap_size);
+    for(int32_t i = 1; i <= state->stack_size; i++) {
+        mark_value(state, marked, state->stack[i]);
+    }
+    for(uint32_t i = 0; i < state->stackframe_size; i++) {
+        mark_value(state, marked, state->stackframe[i]);
+    }
+    for(uint32_t i = 0; i < state->heap_size; i++) {
+        HeapValue* slot = &state->heap[i];
+        if(slot->kind != HEAP_SLOT_BLOCK || slot->elem_type != ELEM_STR) continue;
+        RuntimeValue* elements = slot->data;
+        for(uint32_t j = 0; j < slot->size / sizeof(RuntimeValue); j++) {
+            mark_value(state, marked, elements[j]);
         }
-        if(current_token->inst == INST_GT) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for greather-than check specified.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b > a), .var_type = VAR_TYPE_INT });
-            }
+    }
+    size_t live = 0;
+    for(uint32_t i = 0; i < state->heap_size; i++) {
+        HeapValue* slot = &state->heap[i];
+        if(slot->kind != HEAP_SLOT_STRING) continue;
+        if(marked[i]) {
+            live += slot->size;
+        } else {
+            heap_free(state, slot);
+            state->gc_stats.strings_freed++;
         }
-        if(current_token->inst == INST_LT) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for less-than check specified.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b < a), .var_type = VAR_TYPE_INT });
-            }
+    }
+    free(marked);
+    rebuild_string_table(state, state->string_bucket_count);
+
+    state->gc_allocated = 0;
+    state->gc_threshold = live > GC_MIN_THRESHOLD ? live : GC_MIN_THRESHOLD;
+    uint64_t pause = now_ns() - start;
+    state->gc_stats.collections++;
+    state->gc_stats.pause_total_ns += pause;
+    if(pause > state->gc_stats.pause_max_ns) state->gc_stats.pause_max_ns = pause;
+}
+
+// Resolves 'start count ptr' to the first element of that range of an 
+// allocated block, or NULL when the pointer or the range is invalid.
+void*
+block_range(ProgramState* state, RuntimeValue start, RuntimeValue count, RuntimeValue ptr, HeapValue** block) {
+    *block = heap_get(state, ptr);
+    if(!*block || (*block)->kind != HEAP_SLOT_BLOCK) return NULL;
+    if(value_type(start) != VAR_TYPE_INT || value_type(count) != VAR_TYPE_INT) return NULL;
+    int64_t first = value_payload(start);
+    int64_t length = value_payload(count);
+    if(first < 0 || length < 0 || first + length > block_length(*block)) return NULL;
+    return (char*)(*block)->data + first * elem_width((*block)->elem_type);
+}
+
+// Bulk kernels for one integer element type. They are plain loops, which
+// lets the compiler vectorize the reductions. sort is an insertion sort
+// for short ranges and otherwise a radix sort over the bytes of the 
+// value, skipping bytes every value shares.
+#define DEFINE_RANGE_KERNELS(type, suffix)                                              \
+void                                                                                    \
+range_fill_##suffix(void* data, uint32_t count, int64_t val) {                          \
+    type* elements = data;                                                              \
+    for(uint32_t i = 0; i < count; i++) elements[i] = (type)val;                        \
+}                                                                                       \
+int32_t                                                                                 \
+range_sum_##suffix(const void* data, uint32_t count) {                                  \
+    const type* elements = data;                                                        \
+    uint64_t sum = 0;                                                                   \
+    for(uint32_t i = 0; i < count; i++) sum += (uint64_t)(int64_t)elements[i];          \
+    return (int32_t)sum;                                                                \
+}                                                                                       \
+int32_t                                                                                 \
+range_min_##suffix(const void* data, uint32_t count) {                                  \
+    const type* elements = data;                                                        \
+    type min = elements[0];                                                             \
+    for(uint32_t i = 1; i < count; i++) min = elements[i] < min ? elements[i] : min;    \
+    return (int32_t)min;                                                                \
+}                                                                                       \
+int32_t                                                                                 \
+range_max_##suffix(const void* data, uint32_t count) {                                  \
+    const type* elements = data;                                                        \
+    type max = elements[0];                                                             \
+    for(uint32_t i = 1; i < count; i++) max = elements[i] > max ? elements[i] : max;    \
+    return (int32_t)max;                                                                \
+}                                                                                       \
+int32_t                                                                                 \
+range_compare_##suffix(const void* a, const void* b, uint32_t count) {                  \
+    const type* elements_a = a;                                                         \
+    const type* elements_b = b;                                                         \
+    for(uint32_t i = 0; i < count; i++) {                                               \
+        if(elements_a[i] != elements_b[i]) {                                            \
+            return elements_a[i] < elements_b[i] ? -1 : 1;                              \
+        }                                                                               \
+    }                                                                                   \
+    return 0;                                                                           \
+}                                                                                       \
+void                                                                                    \
+range_sort_##suffix(ProgramState* state, void* data, uint32_t count) {                  \
+    type* elements = data;                                                              \
+    if(count < 64) {                                                                    \
+        for(uint32_t i = 1; i < count; i++) {                                           \
+            type val = elements[i];                                                     \
+            uint32_t j = i;                                                             \
+            for(; j > 0 && elements[j - 1] > val; j--) elements[j] = elements[j - 1];   \
+            elements[j] = val;                                                          \
+        }                                                                               \
+        return;                                                                         \
+    }                                                                                   \
+    /* Values are at most 32 bits wide, flipping the sign bit orders the */             \
+    /* keys as unsigned numbers. */                                                     \
+    const uint32_t bits = sizeof(type) < 4 ? sizeof(type) * 8 : 32;                     \
+    const uint32_t flip = 1u << (bits - 1);                                             \
+    size_t size = sizeof(type) * count;                                                 \
+    type* buffer = checked_alloc(state, NULL, size);                                    \
+    type* from = elements;                                                              \
+    type* to = buffer;                                                                  \
+    for(uint32_t shift = 0; shift < bits; shift += 8) {                                 \
+        uint32_t offsets[256] = {0};                                                    \
+        for(uint32_t i = 0; i < count; i++) {                                           \
+            offsets[(((uint32_t)from[i] ^ flip) >> shift) & 0xff]++;                    \
+        }                                                                               \
+        if(offsets[(((uint32_t)from[0] ^ flip) >> shift) & 0xff] == count) continue;    \
+        uint32_t total = 0;                                                             \
+        for(uint32_t i = 0; i < 256; i++) {                                             \
+            uint32_t bucket_count = offsets[i];                                         \
+            offsets[i] = total;                                                         \
+            total += bucket_count;                                                      \
+        }                                                                               \
+        for(uint32_t i = 0; i < count; i++) {                                           \
+            to[offsets[(((uint32_t)from[i] ^ flip) >> shift) & 0xff]++] = from[i];      \
+        }                                                                               \
+        type* swap = from;                                                              \
+        from = to;                                                                      \
+        to = swap;                                                                      \
+    }                                                                                   \
+    if(from != elements) memcpy(elements, from, size);                                  \
+    free(buffer);                                                                       \
+    state->memory_used -= size;                                                         \
+}                                                                                       \
+
+DEFINE_RANGE_KERNELS(int8_t, i8)
+DEFINE_RANGE_KERNELS(int16_t, i16)
+DEFINE_RANGE_KERNELS(int32_t, i32)
+DEFINE_RANGE_KERNELS(int64_t, i64)
+
+typedef struct {
+    void (*fill)(void* data, uint32_t count, int64_t val);
+    int32_t (*sum)(const void* data, uint32_t count);
+    int32_t (*min)(const void* data, uint32_t count);
+    int32_t (*max)(const void* data, uint32_t count);
+    int32_t (*compare)(const void* a, const void* b, uint32_t count);
+    void (*sort)(ProgramState* state, void* data, uint32_t count);
+} RangeKernels;
+
+#define RANGE_KERNELS(suffix)                                                           \
+    { range_fill_##suffix, range_sum_##suffix, range_min_##suffix,                      \
+      range_max_##suffix, range_compare_##suffix, range_sort_##suffix }
+
+// Blocks of strings only use fill, with handles as 64 bit elements.
+const RangeKernels range_kernels[ELEM_STR + 1] = {
+    [ELEM_I8] = RANGE_KERNELS(i8), [ELEM_I16] = RANGE_KERNELS(i16),
+    [ELEM_I32] = RANGE_KERNELS(i32), [ELEM_I64] = RANGE_KERNELS(i64), 
+    [ELEM_STR] = RANGE_KERNELS(i64)
+};
+
+// Allocates a block for alloc. Blocks of strings start out holding empty 
+// strings, so the collector only finds handles in them and pget always 
+// yields a string.
+HeapHandle
+alloc_block(ProgramState* state, uint32_t length, ElementType type) {
+    HeapHandle handle = heap_alloc(state, length, type);
+    if(type == ELEM_STR) {
+        RuntimeValue empty = value_str(register_literal(state, "", 0));
+        range_kernels[ELEM_STR].fill(state->heap[(uint32_t)handle].data, length, (int64_t)empty);
+    }
+    return handle;
+}
+
+void
+grow_stack(ProgramState* state) {
+    state->stack = grow_buffer(state, state->stack, &state->stack_cap, state->stack_cap + 1, sizeof(RuntimeValue));
+}
+
+// The loader knows how many variables can be in scope at once, so the 
+// stackframe is allocated once up front and never checked at runtime.
+void
+reserve_stackframe(ProgramState* state, uint32_t slots) {
+    state->stackframe = checked_alloc(state, NULL, sizeof(RuntimeValue) * slots);
+    state->stackframe_depths = checked_alloc(state, NULL, sizeof(uint32_t) * slots);
+}
+
+void
+free_program_state(ProgramState* state) {
+    for(uint32_t i = 0; i < state->heap_size; i++) {
+        HeapValue* slot = &state->heap[i];
+        if(slot->kind != HEAP_SLOT_FREE && slot->kind != HEAP_SLOT_LITERAL && slot->size > POOL_MAX_SIZE) 
+            free(slot->data);
+    }
+    for(uint32_t i = 0; i < state->slab_count; i++) {
+        free(state->slabs[i]);
+    }
+    free(state->slabs);
+    free(state->string_buckets);
+    free(state->output);
+    free(state->free_slots);
+    free(state->stack);
+    free(state->heap);
+    free(state->stackframe);
+    free(state->stackframe_depths);
+}
+
+// Reports a syntax error and keeps loading so every error in the script is
+// shown. The program is rejected once loading finishes.
+#define SYNTAX_ERROR(cond, ...) {                                                       \
+    PANIC_ON_ERR(cond, ERR_SYNTAX_ERROR, __VA_ARGS__);                                  \
+    if(cond) error_count++;                                                             \
+}                                                                                       \
+
+TokenPos
+source_position(const uint32_t* line_starts, uint32_t line_count, uint32_t offset, uint32_t call) {
+    uint32_t low = 0;
+    uint32_t high = line_count;
+    while(high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if(line_starts[mid] <= offset) low = mid;
+        else high = mid;
+    }
+    return (TokenPos){ .line = low + 1, .column = offset - line_starts[low] + 1, .call = call };
+}
+
+bool 
+load_program(const char* src, size_t size, Program* program, ProgramState* state, bool record_positions) {
+    Lexer lexer = { .src = src, .size = size };
+
+    *program = (Program){0};
+    uint32_t i = 0;
+
+    SymbolTable symbols = {0};
+
+    // Macro bodies being expanded, innermost last. Each entry holds the 
+    // lexer to resume once the body is exhausted.
+    MacroExpansion* expansions = NULL;
+    uint32_t expansion_count = 0;
+    uint32_t expansion_cap = 0;
+
+    // Variables currently in scope, innermost last. The position of a 
+    // variable in this list is its slot in the runtime stackframe.
+    ScopeVariable* scope_vars = NULL;
+    uint32_t scope_var_count = 0;
+    uint32_t scope_var_cap = 0;
+    uint32_t virtual_stackframe_index = 0;
+    
+    // Token indices of the if and while blocks that are still open, 
+    // innermost last.
+    uint32_t* open_blocks = NULL;
+    uint32_t open_block_count = 0;
+    uint32_t open_block_cap = 0;
+
+    bool on_comment = false;
+    uint32_t error_count = 0;
+
+    // Offsets of the lines in the source and the macro expansion that 
+    // words currently come from, for recording token positions.
+    uint32_t* line_starts = NULL;
+    uint32_t line_count = 0;
+    uint32_t line_cap = 0;
+    uint32_t current_call = 0;
+    if(record_positions) {
+        program->positions = checked_alloc(state, NULL, sizeof(TokenPos));
+        GROW_BUFFER(state, line_starts, line_count, line_cap);
+        line_starts[line_count++] = 0;
+        for(size_t offset = 0; offset < size; offset++) {
+            if(src[offset] != '\n') continue;
+            GROW_BUFFER(state, line_starts, line_count, line_cap);
+            line_starts[line_count++] = offset + 1;
         }
-        if(current_token->inst == INST_GEQ) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for greather-than-equal check specified.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b >= a), .var_type = VAR_TYPE_INT });
-            }
+        GROW_BUFFER(state, program->macro_calls, program->macro_call_count, program->macro_call_cap);
+        program->macro_calls[program->macro_call_count++] = (MacroCall){0};
+    }
+
+    while(true) {
+        StrSlice word;
+        if(!next_word(&lexer, &word, !on_comment)) {
+            if(expansion_count == 0) break;
+            MacroExpansion* expansion = &expansions[--expansion_count];
+            symbols.symbols[expansion->symbol].expanding = false;
+            lexer = expansion->lexer;
+            if(record_positions) current_call = program->macro_calls[current_call].pos.call;
+            continue;
         }
-        if(current_token->inst == INST_LEQ) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Too few values for less-than-equal check specified.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b <= a), .var_type = VAR_TYPE_INT });
-            }
+
+        reserve_program(state, program, i);
+        if(record_positions) {
+            program->positions[i] = source_position(line_starts, line_count, 
+                                                    word.data - src, current_call);
         }
-        if(current_token->inst == INST_LOGICAL_OR) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_OVERFLOW, "Too few values for logical or operation.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b || a), .var_type = VAR_TYPE_INT });
-            }
+
+        if(slice_equals(word, "#") && !on_comment) {
+            on_comment = true;
+        } else if(slice_equals(word, "#>") && on_comment) {
+            on_comment = false;
+            continue;
         }
-        if(current_token->inst == INST_LOGICAL_AND) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_OVERFLOW, "Too few values for logical or operation.");
-            if(stack_peak(state, 1).var_type == VAR_TYPE_INT && stack_peak(state, 2).var_type == VAR_TYPE_INT) {
-                int32_t a = stack_pop(state).data;
-                int32_t b = stack_pop(state).data;
-                stack_push(state, (RuntimeValue){ .data = (int32_t)(b && a), .var_type = VAR_TYPE_INT });
+        if(on_comment) continue;
+
+        if(word.data[0] == '"') {
+            if(word.len < 2 || word.data[word.len - 1] != '"') {
+                SYNTAX_ERROR(true, "Unterminated string literal.");
+                break;
             }
+            set_token(program, i++, INST_STACK_PUSH, value_str(register_literal(state, word.data + 1, word.len - 2)));
+            continue;
         }
-        if(current_token->inst == INST_ELSE) {
-            state->inst_ptr = current_token->val.data;
+        if(is_str_int(word)) {
+            set_token(program, i++, INST_STACK_PUSH, value_int(str_to_int(word)));
+            continue;
         }
+        if(is_str_macro_usage(word)) {
+            // Macros are expanded textually: the lexer continues inside the 
+            // body and returns here once it is exhausted.
+            StrSlice name = { .data = word.data + 1, .len = word.len - 1 };
+            uint32_t symbol_index = intern_symbol(state, &symbols, name);
+            Symbol* macro = &symbols.symbols[symbol_index];
+            SYNTAX_ERROR(!macro->macro_body.data, "Undefined macro '%.*s'.", (int)name.len, name.data);
+            SYNTAX_ERROR(macro->expanding, "Macro '%.*s' expands itself.", (int)name.len, name.data);
+            if(!macro->macro_body.data || macro->expanding) continue;
 
-        if(current_token->inst == INST_ENDIF) {
-            clear_current_stackframe(state);
+            GROW_BUFFER(state, expansions, expansion_count, expansion_cap);
+            expansions[expansion_count++] = (MacroExpansion){ .lexer = lexer, .symbol = symbol_index };
+            macro->expanding = true;
+            lexer = (Lexer){ .src = macro->macro_body.data, .size = macro->macro_body.len };
+            if(record_positions) {
+                GROW_BUFFER(state, program->macro_calls, program->macro_call_count, program->macro_call_cap);
+                MacroCall* call = &program->macro_calls[program->macro_call_count];
+                call->pos = program->positions[i];
+                call->name = checked_alloc(state, NULL, word.len + 1);
+                memcpy(call->name, word.data, word.len);
+                call->name[word.len] = '\0';
+                current_call = program->macro_call_count++;
+            }
+            continue;
+        }
+        if(slice_equals(word, "macro")) {
+            StrSlice name, def, body;
+            bool valid = next_word(&lexer, &name, true) && next_word(&lexer, &def, true) && 
+                slice_equals(def, "def") && is_str_var_name(name);
+            SYNTAX_ERROR(!valid, "Expected 'macro <name> def <body> end'.");
+            if(!valid) continue;
+            bool closed = scan_macro_body(&lexer, &body);
+            SYNTAX_ERROR(!closed, "Macro '%.*s' is never closed with 'end'.", (int)name.len, name.data);
+            if(!closed) break;
+            uint32_t symbol_index = intern_symbol(state, &symbols, name);
+            symbols.symbols[symbol_index].macro_body = body;
+            continue;
         }
 
-        if(current_token->inst == INST_IF || current_token->inst == INST_THEN) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "No value for if check specified.");
-            PANIC_ON_ERR(stack_top(state).var_type != VAR_TYPE_INT, ERR_INVALID_DATA_TYPE, 
-                "Invalid data type for if condition.");
-            int32_t cond = stack_pop(state).data;
-            if(!cond) {
-                if(current_token->inst == INST_IF)
-                    state->found_solution_for_if_block = false;
-                state->inst_ptr = current_token->val.data; 
-            } else {
-                if(current_token->inst == INST_IF) 
-                    state->found_solution_for_if_block = true;
-                if(state->found_solution_for_if_block && current_token->inst == INST_THEN) {
-                    for(uint32_t j = state->inst_ptr; j <= program_size; j++) {
-                        if(program[j].inst != INST_ENDIF) continue;
-                        state->inst_ptr = j;
-                        break;
+        Instruction inst;
+        if(lookup_keyword(word, &inst)) {
+            set_token(program, i, inst, 0);
+            switch(inst) {
+                case INST_INT_TYPE:
+                case INST_STR_TYPE:
+                    program->operands[i] = element_type(word);
+                    break;
+                case INST_HEAP_ALLOC: {
+                    // alloc reads the element type from the type word before it.
+                    bool typed = i > 0 && (program->insts[i - 1] == INST_INT_TYPE || 
+                                           program->insts[i - 1] == INST_STR_TYPE);
+                    SYNTAX_ERROR(!typed, "'alloc' without an element type before it.");
+                    break;
+                }
+                case INST_IF:
+                case INST_WHILE:
+                    GROW_BUFFER(state, open_blocks, open_block_count, open_block_cap);
+                    open_blocks[open_block_count++] = i;
+                    if(inst == INST_IF) virtual_stackframe_index++;
+                    break;
+                case INST_RUN_WHILE:
+                    virtual_stackframe_index++;
+                    break;
+                case INST_PWHILE:
+                    // Until its end, the operand holds the number of variables
+                    // in scope outside the loop, shifted past the reduction.
+                    program->operands[i] = (RuntimeValue)scope_var_count << 8;
+                    GROW_BUFFER(state, open_blocks, open_block_count, open_block_cap);
+                    open_blocks[open_block_count++] = i;
+                    virtual_stackframe_index++;
+                    break;
+                case INST_SUM:
+                case INST_MIN:
+                case INST_MAX:
+                    // A reduction word right after pwhile belongs to the loop.
+                    if(i > 0 && program->insts[i - 1] == INST_PWHILE && !PWHILE_REDUCTION(program->operands[i - 1])) {
+                        program->operands[i - 1] |= inst;
+                        continue;
                     }
-                } else {
-                    state->stackframe_index++;
-                    if(current_token->inst == INST_THEN) {
-                        state->found_solution_for_if_block = true;
+                    break;
+                case INST_ELIF:
+                case INST_ELSE:
+                case INST_THEN: {
+                    bool in_if = open_block_count > 0 && program->insts[open_blocks[open_block_count - 1]] == INST_IF;
+                    SYNTAX_ERROR(!in_if, "'%.*s' outside of an if block.", (int)word.len, word.data);
+                    if(!in_if) continue;
+                    // Only one branch of the chain runs, so each branch starts
+                    // with the variables of the previous one out of scope.
+                    if(inst != INST_THEN) 
+                        pop_scope_variables(&symbols, scope_vars, &scope_var_count, virtual_stackframe_index - 1);
+                    break;
+                }
+                case INST_ENDIF: {
+                    // 'end' closes the innermost open block.
+                    SYNTAX_ERROR(open_block_count == 0, "'end' without an open block.");
+                    if(open_block_count == 0) continue;
+                    uint32_t opener = open_blocks[--open_block_count];
+                    if(program->insts[opener] == INST_WHILE) {
+                        program->insts[i] = INST_END_WHILE;
+                    } else if(program->insts[opener] == INST_PWHILE) {
+                        program->insts[i] = INST_END_PWHILE;
+                        program->operands[i] = program->operands[opener];
                     }
+                    // Variables declared inside the block go out of scope.
+                    virtual_stackframe_index--;
+                    pop_scope_variables(&symbols, scope_vars, &scope_var_count, virtual_stackframe_index);
+                    break;
                 }
+                default:
+                    if(i >= 2 && fold_constants(program, i - 2, inst)) {
+                        i--;
+                        continue;
+                    }
+                    break;
             }
+            i++;
+            continue;
         }
-        if(current_token->inst == INST_HEAP_ALLOC) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "No value for size of memory allocation specified.");
-            PANIC_ON_ERR(program[state->inst_ptr - 1].inst != INST_STR_TYPE &&
-                program[state->inst_ptr - 1].inst != INST_INT_TYPE, ERR_INVALID_DATA_TYPE, "Invalid data type for allocating block");
-
-            VariableType type = VAR_TYPE_INT;
-            if(program[state->inst_ptr - 1].inst == INST_INT_TYPE)
-                type = VAR_TYPE_INT;
-            else if(program[state->inst_ptr - 1].inst == INST_STR_TYPE)
-                type = VAR_TYPE_STR;
-
-            uint32_t heap_ptr = heap_alloc(state, stack_pop(state).data, type); 
-            stack_push(state, (RuntimeValue){ .data = heap_ptr, .heap_ptr = true, .var_type = VAR_TYPE_INT });
-        }
-        if(current_token->inst == INST_HEAP_FREE) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "No pointer for free operation specified.");
-            PANIC_ON_ERR(!stack_top(state).heap_ptr, ERR_INVALID_PTR, "Trying to free stack based value.");
-            PANIC_ON_ERR(stack_top(state).data > state->heap_size, ERR_INVALID_PTR, 
-                "Invalid pointer for free.");
-            
-            heap_free(state, stack_pop(state).data);
-        }
-        if(current_token->inst == INST_PTR_GET_I) {
-            PANIC_ON_ERR(state->stack_size < 2, ERR_STACK_UNDERFLOW, "Not enough values for pget specified.");
-            RuntimeValue heap_index = stack_pop(state);
-            RuntimeValue data_index = stack_pop(state);
-            PANIC_ON_ERR(!heap_index.heap_ptr, ERR_INVALID_PTR, "Trying to pget with stack based value.");
-            PANIC_ON_ERR(heap_index.data > state->heap_size, ERR_INVALID_PTR, 
-                "Invalid pointer for pget.");
-
-            switch (state->heap[heap_index.data].var_type) {
-                case VAR_TYPE_INT: {
-                    size_t* heap_data = (size_t*)state->heap[heap_index.data].data;
-                    stack_push(state, (RuntimeValue) { 
-                        .data = heap_data[data_index.data], 
-                        .var_type = state->heap[heap_index.data].var_type, 
-                        .heap_ptr = false });
-                    break;
+
+        if(is_str_var_name(word)) {
+            uint32_t symbol_index = intern_symbol(state, &symbols, word);
+            Symbol* variable = &symbols.symbols[symbol_index];
+            if(i > 0 && program->insts[i - 1] == INST_ASSIGN) {
+                SYNTAX_ERROR(i < 2, "Assigning variable to nothing."); 
+                Instruction assign = INST_VAR_REASSIGN;
+                if(variable->var_slot == SYMBOL_NONE) {
+                    GROW_BUFFER(state, scope_vars, scope_var_count, scope_var_cap);
+                    scope_vars[scope_var_count] = (ScopeVariable){ 
+                        .symbol = symbol_index, .depth = virtual_stackframe_index };
+                    variable->var_slot = scope_var_count++;
+                    if(scope_var_count > program->frame_slots) program->frame_slots = scope_var_count;
+                    assign = INST_ADD_VAR_TO_STACKFRAME;
                 }
-                case VAR_TYPE_STR: {
-                    char** heap_data = (char**)state->heap[heap_index.data].data;
-                    char* data_at_index = heap_data[data_index.data];
-                    state->heap[state->heap_size++] = (HeapValue){ .data = data_at_index, .var_type = VAR_TYPE_STR };
-                    stack_push(state, (RuntimeValue) {
-                        .data =  state->heap_size - 1,
-                        .heap_ptr = true,
-                        .var_type = VAR_TYPE_STR
-                    });
-                    break;
+                set_token(program, i++, assign, variable->var_slot);
+                continue;
+            } 
+            SYNTAX_ERROR(variable->var_slot == SYMBOL_NONE, 
+                         "Undeclared identifier '%.*s'.", (int)word.len, word.data);
+            if(variable->var_slot == SYMBOL_NONE) continue;
+            set_token(program, i++, INST_VAR_USAGE, variable->var_slot);
+            continue;
+        }
+        SYNTAX_ERROR(true, "Syntax Error: Invalid Token '%.*s'.", (int)word.len, word.data);
+    }
+    SYNTAX_ERROR(open_block_count > 0, "Block opened at token %u is never closed with 'end'.", 
+                 open_block_count > 0 ? open_blocks[open_block_count - 1] : 0);
+    release_buffer(state, open_blocks, sizeof(uint32_t) * open_block_cap);
+    release_buffer(state, scope_vars, sizeof(ScopeVariable) * scope_var_cap);
+    release_buffer(state, expansions, sizeof(MacroExpansion) * expansion_cap);
+    release_buffer(state, line_starts, sizeof(uint32_t) * line_cap);
+    free_symbol_table(state, &symbols);
+    if(error_count > 0) {
+        free_program(program);
+        return false;
+    }
+
+    reserve_program(state, program, i);
+    set_token(program, i, INST_HALT, 0);
+    if(record_positions) program->positions[i] = (TokenPos){0};
+    program->size = i;
+    return true;
+}
+#undef SYNTAX_ERROR
+
+bool 
+load_program_from_file(const char* filepath, Program* program, ProgramState* state, bool record_positions) {
+    MappedFile source;
+    if(!map_file(filepath, &source)) {
+        printf("Lantern: [Error]: Cannot read file '%s'.\n", filepath);
+        return false;
+    }
+    bool loaded = load_program(source.data, source.size, program, state, record_positions);
+    unmap_file(&source);
+    return loaded;
+}
+
+// Resolves every jump target in one pass over the program. Targets are 
+// the index of the next instruction to execute:
+//   if / then     -> start of the next branch (past its elif or else), or 
+//                    the endif when there is none
+//   elif / else   -> the endif, reached when the previous branch finishes
+//   run           -> past the end of the loop
+//   end (while)   -> the loop condition
+//   pwhile        -> past the end of the loop, whose own operand keeps 
+//                    the reduction and the variables outside of it
+// Branch ends of an if chain are threaded through their own operands 
+// until the endif is known.
+void
+crossreference_tokens(ProgramState* state, Program* program) {
+    typedef struct {
+        uint32_t opener;
+        uint32_t pending_cond;
+        uint32_t branch_ends;
+    } Block;
+    RuntimeValue* targets = program->operands;
+    Block* blocks = NULL;
+    uint32_t block_count = 0;
+    uint32_t block_cap = 0;
+    for(uint32_t i = 0; i < program->size; i++) {
+        switch(program->insts[i]) {
+            case INST_IF:
+            case INST_WHILE:
+            case INST_PWHILE:
+                GROW_BUFFER(state, blocks, block_count, block_cap);
+                blocks[block_count++] = (Block){ .opener = i, .pending_cond = i, .branch_ends = SYMBOL_NONE };
+                break;
+            case INST_THEN:
+            case INST_RUN_WHILE:
+                blocks[block_count - 1].pending_cond = i;
+                break;
+            case INST_ELIF:
+            case INST_ELSE: {
+                Block* block = &blocks[block_count - 1];
+                if(block->pending_cond != SYMBOL_NONE) 
+                    targets[block->pending_cond] = i + 1;
+                block->pending_cond = SYMBOL_NONE;
+                targets[i] = block->branch_ends;
+                block->branch_ends = i;
+                break;
+            }
+            case INST_ENDIF: {
+                Block* block = &blocks[--block_count];
+                if(block->pending_cond != SYMBOL_NONE) 
+                    targets[block->pending_cond] = i;
+                for(uint32_t j = block->branch_ends; j != SYMBOL_NONE; ) {
+                    uint32_t next = targets[j];
+                    targets[j] = i;
+                    j = next;
                 }
+                break;
+            }
+            case INST_END_WHILE: {
+                Block* block = &blocks[--block_count];
+                targets[block->pending_cond] = i + 1;
+                targets[i] = block->opener + 1;
+                break;
             }
-        } 
-        if(current_token->inst == INST_PTR_SET_I) {
-            PANIC_ON_ERR(state->stack_size < 1, ERR_STACK_UNDERFLOW, "Not enough values for pset specified.");
-
-            RuntimeValue heap_index = stack_pop(state);
-            RuntimeValue data_index = stack_pop(state);
-            RuntimeValue val = stack_pop(state);
-
-            PANIC_ON_ERR(!heap_index.heap_ptr, ERR_INVALID_PTR, "Trying to pset with stack based value.");
-            PANIC_ON_ERR(heap_index.data > state->heap_size, ERR_INVALID_PTR, 
-                "Invalid pointer for pset.");
-            PANIC_ON_ERR(val.var_type != state->heap[heap_index.data].var_type, 
-                ERR_INVALID_DATA_TYPE, "Assigning value of pointer to different data type");
-
-            switch (state->heap[heap_index.data].var_type) {
-                case VAR_TYPE_INT: {
-                    size_t* heap_data = (size_t*)state->heap[heap_index.data].data;
-                    heap_data[data_index.data] = val.data;
+            case INST_END_PWHILE:
+                targets[blocks[--block_count].opener] = i + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    release_buffer(state, blocks, sizeof(Block) * block_cap);
+}
+
+// Prints the macro calls a token was expanded from, outermost first and
+// each preceded by 'separator'.
+void
+print_macro_chain(FILE* file, const Program* program, uint32_t call, const char* separator) {
+    if(call == 0) return;
+    const MacroCall* macro = &program->macro_calls[call];
+    print_macro_chain(file, program, macro->pos.call, separator);
+    fprintf(file, "%s%s (%u:%u)", separator, macro->name, macro->pos.line, macro->pos.column);
+}
+
+// Value types as the verifier sees them. Pointers are ints as far as type
+// checks go, but remember what their block holds so pget has a known type.
+typedef enum {
+    TYPE_NONE,
+    TYPE_INT,
+    TYPE_STR,
+    TYPE_INT_BLOCK,
+    TYPE_STR_BLOCK,
+    TYPE_ANY
+} AbstractType;
+
+typedef enum {
+    VERIFY_PASSED,
+    // Nothing is wrong as far as the verifier can tell, but it could not 
+    // prove every stack effect either.
+    VERIFY_UNPROVEN,
+    VERIFY_FAILED
+} VerifyResult;
+
+// The verifier gives up on tracking the stack beyond this depth.
+#define VERIFY_MAX_DEPTH 1024
+
+// The state at the start of a block: the types of the variables followed
+// by the types of the values on the stack.
+typedef struct {
+    // -1 once paths with different stack depths meet.
+    int32_t depth;
+    bool reached;
+    bool queued;
+    // The outcome for the block when it was last checked from this state.
+    uint8_t result;
+    uint8_t* types;
+} AbstractState;
+
+AbstractType
+join_types(AbstractType a, AbstractType b) {
+    if(a == b || b == TYPE_NONE) return a;
+    if(a == TYPE_NONE) return b;
+    if(a == TYPE_STR || b == TYPE_STR || a == TYPE_ANY || b == TYPE_ANY) return TYPE_ANY;
+    return TYPE_INT;
+}
+
+VerifyResult
+verify_operands(OperandRule rule, AbstractType a, AbstractType b) {
+    bool known = a != TYPE_NONE && a != TYPE_ANY && b != TYPE_NONE && b != TYPE_ANY;
+    switch(rule) {
+        case OPERANDS_INT:
+            if(a == TYPE_STR || b == TYPE_STR) return VERIFY_FAILED;
+            return known ? VERIFY_PASSED : VERIFY_UNPROVEN;
+        case OPERANDS_SAME:
+            if(!known) return VERIFY_UNPROVEN;
+            return (a == TYPE_STR) == (b == TYPE_STR) ? VERIFY_PASSED : VERIFY_FAILED;
+        default:
+            return VERIFY_PASSED;
+    }
+}
+
+// Merges a state into the one at the start of a block and returns whether
+// that changed it.
+bool
+merge_state(ProgramState* state, AbstractState* into, int32_t depth, const uint8_t* types, uint32_t slots) {
+    if(!into->reached) {
+        size_t size = slots + (depth > 0 ? depth : 0);
+        into->types = memcpy(checked_alloc(state, NULL, size), types, size);
+        into->depth = depth;
+        into->reached = true;
+        return true;
+    }
+    bool changed = false;
+    if(into->depth != depth && into->depth >= 0) {
+        into->depth = -1;
+        changed = true;
+    }
+    uint32_t count = slots + (into->depth > 0 ? into->depth : 0);
+    if(memcmp(into->types, types, count) == 0) return changed;
+    for(uint32_t i = 0; i < count; i++) {
+        uint8_t type = join_types(into->types[i], types[i]);
+        changed |= type != into->types[i];
+        into->types[i] = type;
+    }
+    return changed;
+}
+
+// Reports an error at token 'i' along with the macro calls it came from.
+#define VERIFY_ERROR(err_type, format, ...) {                                           \
+    *result = VERIFY_FAILED;                                                            \
+    if(script) {                                                                        \
+        const TokenPos* pos = &program->positions[i];                                   \
+        PANIC_ON_ERR(true, err_type, "%s:%u:%u: " format, script,                       \
+                     pos->line, pos->column, __VA_ARGS__);                              \
+        if(pos->call) {                                                                 \
+            printf("    in");                                                           \
+            print_macro_chain(stdout, program, pos->call, " ");                         \
+            printf("\n");                                                               \
+        }                                                                               \
+    }                                                                                   \
+}                                                                                       \
+
+// Runs the block starting at token 'i' from the state in 'depth' and 
+// 'types', which are left holding the state at its end. Returns the number
+// of blocks that follow it, stored in 'targets'. The outcome for each 
+// token is merged into 'result' and errors are reported against 'script' 
+// when it is given.
+uint32_t
+verify_block(const Program* program, const uint32_t* block_start, const uint32_t* parallel, uint32_t i, 
+             int32_t* depth, uint8_t* types, uint32_t* targets, VerifyResult* result, const char* script) {
+    const uint8_t* insts = program->insts;
+    const RuntimeValue* operands = program->operands;
+    uint8_t* stack = types + program->frame_slots;
+    for(;; i++) {
+        Instruction inst = insts[i];
+        const StackEffect* effect = &stack_effects[inst];
+        int32_t size = *depth;
+        AbstractType a = size > 0 ? stack[size - 1] : TYPE_NONE;
+        AbstractType b = size > 1 && effect->pops > 1 ? stack[size - 2] : TYPE_INT;
+        bool underflow = size >= 0 && size < effect->pops;
+        VerifyResult operands_result = size < 0 ? VERIFY_UNPROVEN : verify_operands(effect->rule, a, b);
+        if(underflow) {
+            VERIFY_ERROR(ERR_STACK_UNDERFLOW, "'%s' needs %u values on the stack, but there are only %i.", 
+                         inst_names[inst], effect->pops, size);
+        } else if(operands_result == VERIFY_FAILED) {
+            VERIFY_ERROR(ERR_INVALID_DATA_TYPE, "Invalid data types for '%s'.", inst_names[inst]);
+        } else if(operands_result > *result) {
+            *result = operands_result;
+        }
+        // pwhile bodies run on several threads at once, which only share 
+        // the heap for reading and the blocks for pget and pset.
+        if(parallel[i]) {
+            switch(inst) {
+                case INST_HEAP_ALLOC: case INST_HEAP_FREE: case INST_PRINT: case INST_PRINTLN: case INST_SORT:
+                    VERIFY_ERROR(ERR_ILLEGAL_INSTRUCTION, "'%s' cannot run inside of a pwhile loop.", inst_names[inst]);
                     break;
-                }
-                case VAR_TYPE_STR: {       
-                    char** heap_data = (char**)state->heap[heap_index.data].data;
-                    heap_data[data_index.data] = state->heap[val.data].data;
+                case INST_PLUS:
+                    if(a == TYPE_STR) 
+                        VERIFY_ERROR(ERR_ILLEGAL_INSTRUCTION, "Strings cannot be concatenated with '%s' inside of a "
+                                     "pwhile loop.", inst_names[inst]);
+                    break;
+                case INST_VAR_REASSIGN:
+                    if(operands[i] < parallel[i] - 1)
+                        VERIFY_ERROR(ERR_ILLEGAL_INSTRUCTION, "'%s' to a variable declared outside of the pwhile "
+                                     "loop.", inst_names[inst]);
+                    break;
+                default:
                     break;
-                }
             }
         }
-        if(current_token->inst == INST_MACRO_USAGE) {
-            state->call_positions[state->call_positions_count++] = state->inst_ptr;
-            state->inst_ptr = current_token->val.data;
+        if(inst == INST_PWHILE && size > 2) {
+            VERIFY_ERROR(ERR_INVALID_STACK_ACCESS, "'%s' needs its range as the only values on the stack, but "
+                         "there are %i.", inst_names[inst], size);
+        } else if(inst == INST_END_PWHILE && size >= 0) {
+            // An iteration leaves nothing or the int to reduce.
+            int32_t expected = PWHILE_REDUCTION(operands[i]) ? 1 : 0;
+            VerifyResult reduced = expected ? verify_operands(OPERANDS_INT, a, TYPE_INT) : VERIFY_PASSED;
+            if(size != expected || reduced == VERIFY_FAILED) {
+                VERIFY_ERROR(ERR_INVALID_STACK_ACCESS, "An iteration of a pwhile loop has to end with %s on the "
+                             "stack.", expected ? "one int" : "no values");
+            } else if(reduced > *result) {
+                *result = reduced;
+            }
+            if(expected) stack[0] = TYPE_INT;
+        }
+
+        AbstractType pushed = TYPE_INT;
+        switch(inst) {
+            case INST_STACK_PUSH: 
+                pushed = value_type(operands[i]) == VAR_TYPE_STR ? TYPE_STR : TYPE_INT; 
+                break;
+            case INST_STACK_PREV: pushed = b; break;
+            case INST_VAR_USAGE:  pushed = types[operands[i]] ? types[operands[i]] : TYPE_ANY; break;
+            case INST_ADD_VAR_TO_STACKFRAME:
+            case INST_VAR_REASSIGN: 
+                types[operands[i]] = size > 0 ? a : TYPE_ANY; 
+                break;
+            case INST_PLUS:
+                if(a == TYPE_STR && b == TYPE_STR) pushed = TYPE_STR;
+                else if(operands_result != VERIFY_PASSED) pushed = TYPE_ANY;
+                break;
+            case INST_HEAP_ALLOC: 
+                pushed = operands[i - 1] == ELEM_STR ? TYPE_STR_BLOCK : TYPE_INT_BLOCK; 
+                break;
+            case INST_PTR_GET_I:  
+                if(a == TYPE_INT_BLOCK) pushed = TYPE_INT;
+                else pushed = a == TYPE_STR_BLOCK ? TYPE_STR : TYPE_ANY;
+                break;
+            default: 
+                break;
         }
-        if(current_token->inst == INST_END_MACRO) {
-            state->inst_ptr = state->call_positions[state->call_positions_count - 1];
-            state->call_positions_count--;
+        // The paths after an underflow are not checked any further.
+        if(underflow || size < 0 || size + effect->pushes - effect->pops > VERIFY_MAX_DEPTH) {
+            *depth = -1;
+        } else {
+            *depth = size + effect->pushes - effect->pops;
+            for(int32_t j = *depth - effect->pushes; j < *depth; j++) stack[j] = pushed;
         }
-        if(current_token->inst == INST_MACRO) {
-            state->inst_ptr = current_token->val.data;
+
+        switch(inst) {
+            case INST_IF: case INST_THEN: case INST_RUN_WHILE:
+                targets[0] = i + 1;
+                targets[1] = operands[i];
+                return 2;
+            case INST_ELIF: case INST_ELSE: case INST_END_WHILE:
+                targets[0] = operands[i];
+                return 1;
+            case INST_HALT:
+                return 0;
+            default:
+                if(!block_start[i + 1]) break;
+                targets[0] = i + 1;
+                return 1;
         }
-        state->inst_ptr++;
     }
 }
 
-int main(int argc, char** argv) {
-    if(argc < 2) {
-        printf("Lantern: [Error]: Too few arguments specified. Usage: ./lantern <filepath>\n");
-        return 1;
+// Workers of pwhile loops run without any checks, so scripts with such a 
+// loop have to be proven.
+VerifyResult
+reject_unproven_pwhile(const Program* program, uint32_t i, const char* script) {
+    VerifyResult failed;
+    VerifyResult* result = &failed;
+    VERIFY_ERROR(ERR_ILLEGAL_INSTRUCTION, "'%s' needs a script the verifier can prove, without jmp and with the "
+                 "same stack depth on every path.", inst_names[program->insts[i]]);
+    return failed;
+}
+#undef VERIFY_ERROR
+
+// Runs the program over stack depths and value types instead of values,
+// following every branch and iterating loops until the states at the start
+// of each block are stable. A block is checked again whenever its state 
+// changes, so the last check of each block decides the outcome. Programs
+// it proves free of stack underflows and operand type errors run without
+// checks for them. Programs with such an error on some path are rejected,
+// and when 'script' is given every error is reported with the position of
+// its token. The target of jmp is only known at runtime, so programs using
+// it are never proven.
+VerifyResult
+verify_program(ProgramState* state, const Program* program, const char* script) {
+    uint32_t slots = program->frame_slots;
+    // Everything allocated here is freed before returning.
+    size_t memory_used = state->memory_used;
+    // For each token inside of a pwhile loop, the number of variables 
+    // outside of the innermost one plus one.
+    size_t table_size = sizeof(uint32_t) * (program->size + 1);
+    uint32_t* parallel = memset(checked_alloc(state, NULL, table_size), 0, table_size);
+    uint32_t first_pwhile = SYMBOL_NONE;
+    for(uint32_t i = 0; i < program->size; i++) {
+        if(program->insts[i] != INST_PWHILE) continue;
+        if(first_pwhile == SYMBOL_NONE) first_pwhile = i;
+        uint32_t end = program->operands[i] - 1;
+        for(uint32_t j = i + 1; j < end; j++) parallel[j] = PWHILE_OUTER_SLOTS(program->operands[end]) + 1;
     }
-    if(argc > 2) {
-        printf("Lantern: [Error]: Too many arguments specified. Usage: ./lantern <filepath>\n");
-        return 1;
+    // The state index plus one of each token that starts a block.
+    uint32_t* block_start = memset(checked_alloc(state, NULL, table_size), 0, table_size);
+    block_start[0] = 1;
+    for(uint32_t i = 0; i < program->size; i++) {
+        switch(program->insts[i]) {
+            case INST_JUMP:
+                free(block_start);
+                free(parallel);
+                state->memory_used = memory_used;
+                if(first_pwhile != SYMBOL_NONE) return reject_unproven_pwhile(program, first_pwhile, script);
+                return VERIFY_UNPROVEN;
+            case INST_IF: case INST_THEN: case INST_RUN_WHILE:
+                block_start[i + 1] = 1;
+                block_start[program->operands[i]] = 1;
+                break;
+            case INST_ELIF: case INST_ELSE: case INST_END_WHILE:
+                block_start[program->operands[i]] = 1;
+                break;
+            default:
+                break;
+        }
     }
+    uint32_t block_count = 0;
+    for(uint32_t i = 0; i <= program->size; i++) {
+        if(block_start[i]) block_start[i] = ++block_count;
+    }
+
+    size_t states_size = sizeof(AbstractState) * block_count;
+    AbstractState* states = memset(checked_alloc(state, NULL, states_size), 0, states_size);
+    uint32_t* worklist = checked_alloc(state, NULL, sizeof(uint32_t) * block_count);
+    uint32_t work_count = 0;
+    uint8_t* types = memset(checked_alloc(state, NULL, slots + VERIFY_MAX_DEPTH), 0, slots + VERIFY_MAX_DEPTH);
+    uint32_t targets[2];
+
+    merge_state(state, &states[0], 0, types, slots);
+    worklist[work_count++] = 0;
+    while(work_count > 0) {
+        uint32_t start = worklist[--work_count];
+        AbstractState* entry = &states[block_start[start] - 1];
+        entry->queued = false;
+        int32_t depth = entry->depth;
+        memcpy(types, entry->types, slots + (depth > 0 ? depth : 0));
+        VerifyResult result = VERIFY_PASSED;
+        uint32_t target_count = verify_block(program, block_start, parallel, start, &depth, types, targets, 
+                                             &result, NULL);
+        entry->result = result;
+        for(uint32_t j = 0; j < target_count; j++) {
+            AbstractState* next = &states[block_start[targets[j]] - 1];
+            if(merge_state(state, next, depth, types, slots) && !next->queued) {
+                next->queued = true;
+                worklist[work_count++] = targets[j];
+            }
+        }
+    }
+
+    VerifyResult result = VERIFY_PASSED;
+    for(uint32_t i = 0; i < block_count; i++) {
+        if(states[i].reached && states[i].result > result) result = states[i].result;
+    }
+    // Errors are reported by checking the blocks once more in order, so 
+    // they come out in source order.
+    for(uint32_t start = 0; start <= program->size && script && result == VERIFY_FAILED; start++) {
+        if(!block_start[start] || !states[block_start[start] - 1].reached) continue;
+        AbstractState* entry = &states[block_start[start] - 1];
+        int32_t depth = entry->depth;
+        memcpy(types, entry->types, slots + (depth > 0 ? depth : 0));
+        VerifyResult block_result = VERIFY_PASSED;
+        verify_block(program, block_start, parallel, start, &depth, types, targets, &block_result, script);
+    }
+    if(result == VERIFY_UNPROVEN && first_pwhile != SYMBOL_NONE) 
+        result = reject_unproven_pwhile(program, first_pwhile, script);
+
+    for(uint32_t i = 0; i < block_count; i++) {
+        free(states[i].types);
+    }
+    free(states);
+    free(worklist);
+    free(types);
+    free(block_start);
+    free(parallel);
+    state->memory_used = memory_used;
+    return result;
+}
+
+// Returns the number of tokens a superinstruction starting at 'i' would
+// replace, or 0 when none applies.
+uint32_t
+match_superinstruction(const Program* program, uint32_t i, Instruction* fused) {
+    const uint8_t* t = &program->insts[i];
+    uint32_t left = program->size - i;
+    if(t[0] != INST_VAR_USAGE) return 0;
+
+    // x c + = y
+    if(left >= 5 && is_int_push(program, i + 1) && (t[2] == INST_PLUS || t[2] == INST_MINUS) &&
+       t[3] == INST_ASSIGN && t[4] == INST_VAR_REASSIGN) {
+        *fused = t[2] == INST_PLUS ? INST_VAR_ADD_CONST : INST_VAR_SUB_CONST;
+        return 5;
+    }
+    // x c % k ==, for a c that % never fails or wraps on
+    if(left >= 5 && is_int_push(program, i + 1) && value_payload(program->operands[i + 1]) > 0 && t[2] == INST_MOD &&
+       is_int_push(program, i + 3) && is_int_compare(t[4])) {
+        *fused = INST_VAR_MOD_CONST_CMP_CONST;
+        return 5;
+    }
+    // x c < run, x c < if
+    if(left >= 4 && is_int_push(program, i + 1) && is_int_compare(t[2]) && 
+       (t[3] == INST_RUN_WHILE || t[3] == INST_IF)) {
+        *fused = t[3] == INST_RUN_WHILE ? INST_VAR_CMP_CONST_RUN : INST_VAR_CMP_CONST_IF;
+        return 4;
+    }
+    // i ptr pget, i ptr pset
+    if(left >= 3 && t[1] == INST_VAR_USAGE && (t[2] == INST_PTR_GET_I || t[2] == INST_PTR_SET_I)) {
+        *fused = t[2] == INST_PTR_GET_I ? INST_VAR_PGET : INST_VAR_PSET;
+        return 3;
+    }
+    return 0;
+}
+
+// Rewrites common idioms into superinstructions. The fused opcode replaces
+// the first token of the idiom and the remaining tokens are left untouched:
+// the handler reads its operands from them and skips past them, and when 
+// its type guard fails it runs the first token as a plain INST_VAR_USAGE
+// and lets the original sequence execute. Jump targets therefore stay 
+// valid, as long as no target points into the middle of an idiom.
+void
+optimize_program(Program* program) {
+    bool* is_jump_target = calloc(program->size + 1, sizeof(bool));
+    for(uint32_t i = 0; i < program->size; i++) {
+        switch(program->insts[i]) {
+            case INST_JUMP:
+                // Any token can be the target of a jmp.
+                free(is_jump_target);
+                return;
+            case INST_IF: case INST_THEN: case INST_ELIF: case INST_ELSE:
+            case INST_RUN_WHILE: case INST_END_WHILE: case INST_PWHILE:
+                is_jump_target[program->operands[i]] = true;
+                break;
+            default:
+                break;
+        }
+    }
+    for(uint32_t i = 0; i < program->size; i++) {
+        Instruction fused;
+        uint32_t len = match_superinstruction(program, i, &fused);
+        if(!len) continue;
+        bool splits_target = false;
+        for(uint32_t j = i + 1; j < i + len; j++) {
+            splits_target |= is_jump_target[j];
+        }
+        if(splits_target) continue;
+        program->insts[i] = fused;
+        i += len - 1;
+    }
+    free(is_jump_target);
+}
+
+#ifdef LANTERN_JIT
+// A baseline compiler for hot loops. Once a while loop got back to its
+// condition JIT_HOT_LOOP times, the loop is translated to machine code by
+// emitting a fixed template for each of its instructions. The stack depth
+// is known at every token, so each stack slot the loop uses has a fixed
+// place: one of jit_slot_regs or, past those, the native stack frame.
+// Variables stay in the stackframe. Values stay boxed, the integer 
+// templates work on the low 32 bits and put the tag back afterwards.
+//
+// The code leaves through exits: past the loop when its condition fails,
+// or before an instruction that cannot be done in place at runtime (+ on
+// strings, errors in print, pget and pset). Each exit writes the stack 
+// slots back and names the token to resume at, so the interpreter carries
+// on exactly where the code stopped. A loop that had to leave early is 
+// dropped and interpreted from then on.
+#define JIT_HOT_LOOP 100
+#define JIT_REJECTED UINT32_MAX
+#define JIT_SLOT_REGS 4
+#define JIT_MAX_DEPTH 32
+// The frame pointer and the spilled slots, which with the six registers
+// the prologue pushes keeps the stack aligned for calls.
+#define JIT_FRAME_SIZE (8 * (1 + JIT_MAX_DEPTH - JIT_SLOT_REGS))
+
+typedef enum {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+} JitReg;
+
+// Condition codes of jcc and setcc, JIT_ALWAYS makes a plain jmp.
+typedef enum {
+    COND_E = 0x4, COND_NE = 0x5, COND_L = 0xc, COND_GE = 0xd, COND_LE = 0xe, COND_G = 0xf,
+    JIT_ALWAYS = -1
+} JitCond;
+
+// Callee saved, so helper calls leave the stack slots alone. rbp holds the
+// stackframe and r15 the tag of ints.
+const JitReg jit_slot_regs[JIT_SLOT_REGS] = { REG_RBX, REG_R12, REG_R13, REG_R14 };
+
+typedef struct {
+    ProgramState* state;
+    RuntimeValue* stackframe;
+    // Where the stack slots are written back to on exit, above the values
+    // that were on the stack when the loop was entered.
+    RuntimeValue* stack;
+} JitFrame;
+
+// Returns the index of the exit it left through.
+typedef uint32_t (*JitFunction)(JitFrame* frame);
+
+// A variable the loop declared, with the block nesting it was declared in
+// relative to the loop condition.
+typedef struct {
+    uint32_t slot;
+    uint32_t nest;
+} JitDecl;
+
+// The interpreter state at an exit, relative to the one the loop was 
+// entered with.
+typedef struct {
+    uint32_t ip;
+    uint32_t depth;
+    uint32_t nest;
+    // The variables declared by the loop that are in scope at the exit.
+    uint32_t first_decl;
+    uint32_t decl_count;
+    bool early;
+} JitExit;
+
+struct JitLoop {
+    void* code;
+    size_t code_size;
+    uint32_t head;
+    uint32_t max_depth;
+    JitExit* exits;
+    JitDecl* decls;
+};
+
+typedef struct {
+    // Offset of the rel32 to patch and the token or exit it jumps to.
+    uint32_t at;
+    uint32_t target;
+    bool exit;
+} JitFixup;
+
+typedef struct {
+    const Program* program;
+    uint32_t head;
+    uint32_t end;
+    bool failed;
+
+    uint8_t* code;
+    uint32_t size;
+    uint32_t cap;
+    // Per token of the loop: whether a branch lands on it, the code offset
+    // and the stack depth there (-1 until known).
+    bool* is_target;
+    uint32_t* offsets;
+    int32_t* depths;
+    JitFixup* fixups;
+    uint32_t fixup_count;
+    uint32_t fixup_cap;
+
+    JitExit* exits;
+    uint32_t exit_count;
+    uint32_t exit_cap;
+    JitDecl* decls;
+    uint32_t decl_count;
+    uint32_t decl_cap;
+    // The variables declared by the loop that are in scope, innermost last.
+    JitDecl* scope;
+    uint32_t scope_count;
+    uint32_t scope_cap;
+
+    uint32_t depth;
+    uint32_t max_depth;
+    uint32_t nest;
+    // A pushed constant that is not in its slot yet, so the operator after
+    // it can take it as an immediate.
+    bool pending;
+    RuntimeValue pending_value;
+} JitCompiler;
+
+void
+jit_byte(JitCompiler* c, uint8_t byte) {
+    GROW_ARRAY(c->code, c->size, c->cap);
+    c->code[c->size++] = byte;
+}
+
+void
+jit_bytes(JitCompiler* c, const void* data, uint32_t size) {
+    for(uint32_t i = 0; i < size; i++) {
+        jit_byte(c, ((const uint8_t*)data)[i]);
+    }
+}
+
+void
+jit_u32(JitCompiler* c, uint32_t val) {
+    jit_bytes(c, &val, sizeof(val));
+}
+
+// The REX prefix for 64 bit operands and for r8-r15 in the reg and rm 
+// fields, left out when an instruction needs none of them.
+void
+jit_rex(JitCompiler* c, bool wide, JitReg reg, JitReg rm) {
+    uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+    if(rex != 0x40) jit_byte(c, rex);
+}
+
+// An instruction on two registers, 'opcode' may carry the 0x0f escape in
+// its high byte.
+void
+jit_op_rr(JitCompiler* c, bool wide, uint16_t opcode, JitReg reg, JitReg rm) {
+    jit_rex(c, wide, reg, rm);
+    if(opcode > 0xff) jit_byte(c, opcode >> 8);
+    jit_byte(c, opcode);
+    jit_byte(c, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// An instruction on a register and [base + disp].
+void
+jit_op_rm(JitCompiler* c, bool wide, uint8_t opcode, JitReg reg, JitReg base, int32_t disp) {
+    jit_rex(c, wide, reg, base);
+    jit_byte(c, opcode);
+    jit_byte(c, 0x80 | (reg & 7) << 3 | (base & 7));
+    if((base & 7) == REG_RSP) jit_byte(c, 0x24);
+    jit_u32(c, disp);
+}
+
+// add (0), or (1), and (4), sub (5) and cmp (7) with an immediate.
+void
+jit_op_ri(JitCompiler* c, bool wide, uint8_t ext, JitReg rm, int32_t imm) {
+    jit_rex(c, wide, 0, rm);
+    jit_byte(c, 0x81);
+    jit_byte(c, 0xc0 | ext << 3 | (rm & 7));
+    jit_u32(c, imm);
+}
+
+void
+jit_mov_imm(JitCompiler* c, JitReg reg, uint64_t imm) {
+    jit_rex(c, true, 0, reg);
+    jit_byte(c, 0xb8 | (reg & 7));
+    jit_bytes(c, &imm, sizeof(imm));
+}
+
+void
+jit_call(JitCompiler* c, uintptr_t function) {
+    jit_mov_imm(c, REG_RAX, function);
+    jit_op_rr(c, false, 0xff, 2, REG_RAX);
+}
+
+// Jumps to the token or exit 'target', patched once the code is complete.
+void
+jit_jump(JitCompiler* c, JitCond cond, uint32_t target, bool to_exit) {
+    if(cond == JIT_ALWAYS) {
+        jit_byte(c, 0xe9);
+    } else {
+        jit_byte(c, 0x0f);
+        jit_byte(c, 0x80 | cond);
+    }
+    GROW_ARRAY(c->fixups, c->fixup_count, c->fixup_cap);
+    c->fixups[c->fixup_count++] = (JitFixup){ .at = c->size, .target = target, .exit = to_exit };
+    jit_u32(c, 0);
+}
+
+int32_t
+jit_spill_offset(uint32_t slot) {
+    return 8 * (1 + slot - JIT_SLOT_REGS);
+}
+
+void
+jit_load_slot(JitCompiler* c, JitReg reg, uint32_t slot) {
+    if(slot >= JIT_SLOT_REGS) {
+        jit_op_rm(c, true, 0x8b, reg, REG_RSP, jit_spill_offset(slot));
+    } else if(jit_slot_regs[slot] != reg) {
+        jit_op_rr(c, true, 0x89, jit_slot_regs[slot], reg);
+    }
+}
+
+void
+jit_store_slot(JitCompiler* c, uint32_t slot, JitReg reg) {
+    if(slot >= JIT_SLOT_REGS) {
+        jit_op_rm(c, true, 0x89, reg, REG_RSP, jit_spill_offset(slot));
+    } else if(jit_slot_regs[slot] != reg) {
+        jit_op_rr(c, true, 0x89, reg, jit_slot_regs[slot]);
+    }
+}
+
+// The register holding a slot, which is 'scratch' for spilled slots.
+JitReg
+jit_slot_operand(JitCompiler* c, uint32_t slot, JitReg scratch) {
+    if(slot < JIT_SLOT_REGS) return jit_slot_regs[slot];
+    jit_load_slot(c, scratch, slot);
+    return scratch;
+}
+
+// Stores a pending constant into its slot.
+void
+jit_flush(JitCompiler* c) {
+    if(!c->pending) return;
+    c->pending = false;
+    uint32_t slot = c->depth - 1;
+    JitReg reg = slot < JIT_SLOT_REGS ? jit_slot_regs[slot] : REG_RAX;
+    jit_mov_imm(c, reg, c->pending_value);
+    jit_store_slot(c, slot, reg);
+}
+
+uint32_t
+jit_add_exit(JitCompiler* c, uint32_t ip, bool early) {
+    GROW_ARRAY(c->exits, c->exit_count, c->exit_cap);
+    c->exits[c->exit_count] = (JitExit){ .ip = ip, .depth = c->depth, .nest = c->nest, 
+                                         .first_decl = c->decl_count, .decl_count = c->scope_count, 
+                                         .early = early };
+    for(uint32_t i = 0; i < c->scope_count; i++) {
+        GROW_ARRAY(c->decls, c->decl_count, c->decl_cap);
+        c->decls[c->decl_count++] = c->scope[i];
+    }
+    return c->exit_count++;
+}
+
+// Leaves the loop before token 'ip' when 'cond' holds.
+void
+jit_early_exit(JitCompiler* c, JitCond cond, uint32_t ip) {
+    jit_jump(c, cond, jit_add_exit(c, ip, true), true);
+}
+
+// Branches to token 'target', which leaves the loop when it lies outside.
+void
+jit_branch(JitCompiler* c, JitCond cond, uint32_t target) {
+    if(target < c->head || target > c->end) {
+        jit_jump(c, cond, jit_add_exit(c, target, false), true);
+        return;
+    }
+    int32_t* depth = &c->depths[target - c->head];
+    if(*depth >= 0 && *depth != (int32_t)c->depth) c->failed = true;
+    *depth = c->depth;
+    jit_jump(c, cond, target - c->head, false);
+}
+
+// Drops the variables declared at a nesting of 'nest' or deeper.
+void
+jit_close_scope(JitCompiler* c, uint32_t nest) {
+    while(c->scope_count > 0 && c->scope[c->scope_count - 1].nest >= nest) c->scope_count--;
+}
+
+void
+jit_load_state(JitCompiler* c, JitReg reg) {
+    jit_op_rm(c, true, 0x8b, reg, REG_RSP, 0);
+    jit_op_rm(c, true, 0x8b, reg, reg, offsetof(JitFrame, state));
+}
+
+// b a op, with the result replacing b. It is computed in the register of
+// b, or rax when b is spilled, with a in its own register, rcx or an 
+// immediate when it is a pending int constant. idiv traps on a divisor of
+// 0, and of -1 for INT32_MIN, so those leave for the interpreter.
+void
+jit_binary_op(JitCompiler* c, Instruction inst, uint32_t ip) {
+    int32_t imm_val = value_payload(c->pending_value);
+    bool imm = c->pending && value_tag(c->pending_value) == VALUE_TAG_INT && 
+               inst != INST_LOGICAL_AND && inst != INST_LOGICAL_OR &&
+               !((inst == INST_DIV || inst == INST_MOD) && (imm_val == 0 || imm_val == -1));
+    if(!imm) jit_flush(c);
+    c->pending = false;
+    uint32_t b = c->depth - 2;
+    JitReg acc = jit_slot_operand(c, b, REG_RAX);
+    JitReg src = imm ? REG_RCX : jit_slot_operand(c, b + 1, REG_RCX);
+    switch(inst) {
+        case INST_PLUS:
+            if(!imm) {
+                // Strings are concatenated by the interpreter.
+                jit_op_rr(c, true, 0x89, src, REG_RDX);
+                jit_op_rr(c, true, 0xc1, 5, REG_RDX);
+                jit_byte(c, VALUE_TAG_SHIFT);
+                jit_op_ri(c, false, 7, REG_RDX, VALUE_BOX(VALUE_TAG_STR, 0) >> VALUE_TAG_SHIFT);
+                jit_early_exit(c, COND_E, ip);
+                jit_op_rr(c, false, 0x01, src, acc);
+            } else {
+                jit_op_ri(c, false, 0, acc, imm_val);
+            }
+            break;
+        case INST_MINUS:
+            if(imm) jit_op_ri(c, false, 5, acc, imm_val);
+            else jit_op_rr(c, false, 0x29, src, acc);
+            break;
+        case INST_MUL:
+            if(imm) {
+                jit_op_rr(c, false, 0x69, acc, acc);
+                jit_u32(c, imm_val);
+            } else {
+                jit_op_rr(c, false, 0x0faf, acc, src);
+            }
+            break;
+        case INST_DIV:
+        case INST_MOD:
+            if(imm) {
+                jit_rex(c, false, 0, REG_RCX);
+                jit_byte(c, 0xb8 | REG_RCX);
+                jit_u32(c, imm_val);
+            } else {
+                jit_op_ri(c, false, 7, src, 0);
+                jit_early_exit(c, COND_E, ip);
+                jit_op_ri(c, false, 7, src, -1);
+                jit_early_exit(c, COND_E, ip);
+            }
+            if(acc != REG_RAX) jit_op_rr(c, false, 0x89, acc, REG_RAX);
+            jit_byte(c, 0x99);
+            jit_op_rr(c, false, 0xf7, 7, src);
+            jit_op_rr(c, false, 0x89, inst == INST_DIV ? REG_RAX : REG_RDX, acc);
+            break;
+        case INST_LOGICAL_AND:
+        case INST_LOGICAL_OR:
+            jit_op_rr(c, false, 0x85, acc, acc);
+            jit_op_rr(c, false, 0x0f90 | COND_NE, 0, REG_RDX);
+            jit_op_rr(c, false, 0x85, src, src);
+            jit_op_rr(c, false, 0x0f90 | COND_NE, 0, REG_RAX);
+            jit_op_rr(c, false, inst == INST_LOGICAL_AND ? 0x20 : 0x08, REG_RDX, REG_RAX);
+            jit_op_rr(c, false, 0x0fb6, acc, REG_RAX);
+            break;
+        default: {
+            // == and != compare the handles of strings, which are interned.
+            JitCond cond = inst == INST_EQ ? COND_E : inst == INST_NEQ ? COND_NE :
+                           inst == INST_GT ? COND_G : inst == INST_LT ? COND_L :
+                           inst == INST_GEQ ? COND_GE : COND_LE;
+            if(imm) jit_op_ri(c, false, 7, acc, imm_val);
+            else jit_op_rr(c, false, 0x39, src, acc);
+            jit_op_rr(c, false, 0x0f90 | cond, 0, REG_RAX);
+            jit_op_rr(c, false, 0x0fb6, acc, REG_RAX);
+            break;
+        }
+    }
+    jit_op_rr(c, true, 0x09, REG_R15, acc);
+    jit_store_slot(c, b, acc);
+    c->depth--;
+}
+
+// The instruction a token stands for in the loop: superinstructions start
+// with a variable read and type specialized forms are their generic one.
+Instruction
+jit_plain_instruction(Instruction inst) {
+    switch(inst) {
+        case INST_VAR_ADD_CONST: case INST_VAR_SUB_CONST: case INST_VAR_MOD_CONST_CMP_CONST:
+        case INST_VAR_CMP_CONST_RUN: case INST_VAR_CMP_CONST_IF: case INST_VAR_PGET: case INST_VAR_PSET:
+            return INST_VAR_USAGE;
+        case INST_PLUS_INT: case INST_PLUS_STR: return INST_PLUS;
+        case INST_EQ_INT: case INST_EQ_STR: return INST_EQ;
+        case INST_NEQ_INT: case INST_NEQ_STR: return INST_NEQ;
+        default: return inst;
+    }
+}
+
+// pget and pset for compiled loops. They return 0, which is no value, and
+// false where exec_program reports an error, and leave that to it.
+RuntimeValue
+jit_pget(ProgramState* state, RuntimeValue ptr, RuntimeValue index) {
+    HeapValue* block = heap_get(state, ptr);
+    uint32_t i = value_payload(index);
+    if(!block || block->kind != HEAP_SLOT_BLOCK || (state->check_bounds && i >= block_length(block))) 
+        return 0;
+    if(block->elem_type == ELEM_STR) return ((RuntimeValue*)block->data)[i];
+    return value_int(block_get_int(block, i));
+}
+
+bool
+jit_pset(ProgramState* state, RuntimeValue ptr, RuntimeValue index, RuntimeValue val) {
+    HeapValue* block = heap_get(state, ptr);
+    uint32_t i = value_payload(index);
+    if(!block || block->kind != HEAP_SLOT_BLOCK || value_type(val) != elem_var_type(block->elem_type) || 
+       (state->check_bounds && i >= block_length(block))) 
+        return false;
+    if(block->elem_type == ELEM_STR) {
+        ((RuntimeValue*)block->data)[i] = val;
+    } else {
+        block_set_int(block, i, value_payload(val));
+    }
+    return true;
+}
+
+void
+jit_compile_instruction(JitCompiler* c, uint32_t i) {
+    const Program* program = c->program;
+    Instruction inst = jit_plain_instruction(program->insts[i]);
+    if(c->depth < stack_effects[inst].pops) {
+        c->failed = true;
+        return;
+    }
+    switch(inst) {
+        case INST_STACK_PUSH:
+            jit_flush(c);
+            c->pending = true;
+            c->pending_value = program->operands[i];
+            c->depth++;
+            break;
+        case INST_VAR_USAGE: {
+            jit_flush(c);
+            JitReg reg = c->depth < JIT_SLOT_REGS ? jit_slot_regs[c->depth] : REG_RAX;
+            jit_op_rm(c, true, 0x8b, reg, REG_RBP, program->operands[i] * sizeof(RuntimeValue));
+            jit_store_slot(c, c->depth++, reg);
+            break;
+        }
+        case INST_ADD_VAR_TO_STACKFRAME:
+        case INST_VAR_REASSIGN: {
+            jit_flush(c);
+            JitReg reg = jit_slot_operand(c, --c->depth, REG_RAX);
+            jit_op_rm(c, true, 0x89, reg, REG_RBP, program->operands[i] * sizeof(RuntimeValue));
+            if(inst == INST_ADD_VAR_TO_STACKFRAME) {
+                GROW_ARRAY(c->scope, c->scope_count, c->scope_cap);
+                c->scope[c->scope_count++] = (JitDecl){ .slot = program->operands[i], .nest = c->nest };
+            }
+            break;
+        }
+        case INST_PLUS: case INST_MINUS: case INST_MUL: case INST_DIV: case INST_MOD:
+        case INST_EQ: case INST_NEQ: case INST_GT: case INST_LT: case INST_GEQ: case INST_LEQ:
+        case INST_LOGICAL_AND: case INST_LOGICAL_OR:
+            jit_binary_op(c, inst, i);
+            break;
+        case INST_IF:
+        case INST_THEN:
+        case INST_RUN_WHILE: {
+            jit_flush(c);
+            JitReg reg = jit_slot_operand(c, --c->depth, REG_RAX);
+            jit_op_rr(c, false, 0x85, reg, reg);
+            if(inst == INST_IF) c->nest++;
+            jit_branch(c, COND_E, program->operands[i]);
+            if(inst == INST_RUN_WHILE) c->nest++;
+            break;
+        }
+        case INST_ELIF:
+        case INST_ELSE:
+            jit_flush(c);
+            jit_close_scope(c, c->nest);
+            jit_branch(c, JIT_ALWAYS, program->operands[i]);
+            break;
+        case INST_ENDIF:
+        case INST_END_WHILE:
+            jit_flush(c);
+            jit_close_scope(c, c->nest--);
+            if(inst == INST_END_WHILE) jit_branch(c, JIT_ALWAYS, program->operands[i]);
+            break;
+        case INST_PRINT:
+        case INST_PRINTLN:
+            jit_flush(c);
+            jit_load_slot(c, REG_RSI, c->depth - 1);
+            jit_load_state(c, REG_RDI);
+            jit_rex(c, false, 0, REG_RDX);
+            jit_byte(c, 0xb8 | REG_RDX);
+            jit_u32(c, inst == INST_PRINTLN);
+            jit_call(c, (uintptr_t)print_value);
+            jit_op_rr(c, false, 0x84, REG_RAX, REG_RAX);
+            jit_early_exit(c, COND_E, i);
+            c->depth--;
+            break;
+        case INST_PTR_GET_I:
+            jit_flush(c);
+            jit_load_slot(c, REG_RSI, c->depth - 1);
+            jit_load_slot(c, REG_RDX, c->depth - 2);
+            jit_load_state(c, REG_RDI);
+            jit_call(c, (uintptr_t)jit_pget);
+            jit_op_rr(c, true, 0x85, REG_RAX, REG_RAX);
+            jit_early_exit(c, COND_E, i);
+            jit_store_slot(c, c->depth - 2, REG_RAX);
+            c->depth--;
+            break;
+        case INST_PTR_SET_I:
+            jit_flush(c);
+            jit_load_slot(c, REG_RSI, c->depth - 1);
+            jit_load_slot(c, REG_RDX, c->depth - 2);
+            jit_load_slot(c, REG_RCX, c->depth - 3);
+            jit_load_state(c, REG_RDI);
+            jit_call(c, (uintptr_t)jit_pset);
+            jit_op_rr(c, false, 0x84, REG_RAX, REG_RAX);
+            jit_early_exit(c, COND_E, i);
+            c->depth -= 3;
+            break;
+        case INST_WHILE:
+        case INST_ASSIGN:
+        case INST_INT_TYPE:
+        case INST_STR_TYPE:
+            jit_flush(c);
+            break;
+        default:
+            c->failed = true;
+            break;
+    }
+    if(c->depth > c->max_depth) c->max_depth = c->depth;
+    if(c->max_depth > JIT_MAX_DEPTH) c->failed = true;
+}
+
+// Writes the stack slots back and returns the index of the exit.
+void
+jit_compile_exit(JitCompiler* c, uint32_t index, uint32_t epilogue) {
+    const JitExit* exit = &c->exits[index];
+    if(exit->depth > 0) {
+        jit_op_rm(c, true, 0x8b, REG_RCX, REG_RSP, 0);
+        jit_op_rm(c, true, 0x8b, REG_RCX, REG_RCX, offsetof(JitFrame, stack));
+    }
+    for(uint32_t slot = 0; slot < exit->depth; slot++) {
+        JitReg reg = jit_slot_operand(c, slot, REG_RAX);
+        jit_op_rm(c, true, 0x89, reg, REG_RCX, slot * sizeof(RuntimeValue));
+    }
+    jit_byte(c, 0xb8 | REG_RAX);
+    jit_u32(c, index);
+    jit_byte(c, 0xe9);
+    jit_u32(c, epilogue - (c->size + 4));
+}
+
+// Compiles the loop whose condition starts at 'head', returns NULL when it
+// uses instructions there are no templates for or the program is not 
+// verified.
+JitLoop*
+jit_compile_loop(const Program* program, uint32_t head) {
+    if(!program->verified) return NULL;
+    uint32_t end = head;
+    while(program->insts[end] != INST_END_WHILE || program->operands[end] != head) end++;
+    uint32_t len = end - head + 1;
+    JitCompiler c = { .program = program, .head = head, .end = end };
+    c.is_target = calloc(len, sizeof(bool));
+    c.offsets = calloc(len, sizeof(uint32_t));
+    c.depths = malloc(len * sizeof(int32_t));
+    memset(c.depths, 0xff, len * sizeof(int32_t));
+    for(uint32_t i = head; i <= end; i++) {
+        switch(program->insts[i]) {
+            case INST_IF: case INST_THEN: case INST_ELIF: case INST_ELSE:
+            case INST_RUN_WHILE: case INST_END_WHILE:
+                if(program->operands[i] >= head && program->operands[i] <= end) 
+                    c.is_target[program->operands[i] - head] = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    const JitReg saved[] = { REG_RBP, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15 };
+    for(uint32_t i = 0; i < 6; i++) {
+        jit_rex(&c, false, 0, saved[i]);
+        jit_byte(&c, 0x50 | (saved[i] & 7));
+    }
+    jit_op_ri(&c, true, 5, REG_RSP, JIT_FRAME_SIZE);
+    jit_op_rm(&c, true, 0x89, REG_RDI, REG_RSP, 0);
+    jit_op_rm(&c, true, 0x8b, REG_RBP, REG_RDI, offsetof(JitFrame, stackframe));
+    jit_mov_imm(&c, REG_R15, value_int(0));
+    c.depths[0] = 0;
+
+    // Tokens after a jmp are only reached through branches, which tell the
+    // stack depth there.
+    bool reachable = true;
+    uint32_t token = head;
+    for(; token <= end && !c.failed; token++) {
+        uint32_t at = token - head;
+        if(c.is_target[at]) {
+            jit_flush(&c);
+            if(!reachable) {
+                if(c.depths[at] < 0) break;
+                c.depth = c.depths[at];
+            } else if(c.depths[at] >= 0 && c.depths[at] != (int32_t)c.depth) {
+                break;
+            }
+            c.depths[at] = c.depth;
+            c.offsets[at] = c.size;
+        } else if(!reachable) {
+            break;
+        }
+        reachable = program->insts[token] != INST_ELIF && program->insts[token] != INST_ELSE && 
+                    program->insts[token] != INST_END_WHILE;
+        jit_compile_instruction(&c, token);
+    }
+
+    JitLoop* loop = NULL;
+    if(token > end && !c.failed) {
+        uint32_t epilogue = c.size;
+        jit_op_ri(&c, true, 0, REG_RSP, JIT_FRAME_SIZE);
+        for(int32_t i = 5; i >= 0; i--) {
+            jit_rex(&c, false, 0, saved[i]);
+            jit_byte(&c, 0x58 | (saved[i] & 7));
+        }
+        jit_byte(&c, 0xc3);
+        uint32_t* exit_offsets = malloc(c.exit_count * sizeof(uint32_t) + 1);
+        for(uint32_t i = 0; i < c.exit_count; i++) {
+            exit_offsets[i] = c.size;
+            jit_compile_exit(&c, i, epilogue);
+        }
+        for(uint32_t i = 0; i < c.fixup_count; i++) {
+            JitFixup* fixup = &c.fixups[i];
+            uint32_t target = fixup->exit ? exit_offsets[fixup->target] : c.offsets[fixup->target];
+            int32_t rel = target - (fixup->at + 4);
+            memcpy(c.code + fixup->at, &rel, sizeof(rel));
+        }
+        free(exit_offsets);
+
+        void* code = mmap(NULL, c.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(code != MAP_FAILED) {
+            memcpy(code, c.code, c.size);
+            mprotect(code, c.size, PROT_READ | PROT_EXEC);
+            loop = malloc(sizeof(JitLoop));
+            *loop = (JitLoop){ .code = code, .code_size = c.size, .head = head, .max_depth = c.max_depth,
+                               .exits = c.exits, .decls = c.decls };
+            c.exits = NULL;
+            c.decls = NULL;
+        }
+    }
+    free(c.code);
+    free(c.is_target);
+    free(c.offsets);
+    free(c.depths);
+    free(c.fixups);
+    free(c.exits);
+    free(c.decls);
+    free(c.scope);
+    return loop;
+}
+
+void
+jit_free_loop(JitLoop* loop) {
+    munmap(loop->code, loop->code_size);
+    free(loop->exits);
+    free(loop->decls);
+    free(loop);
+}
+
+// The compiled form of the loop whose condition starts at 'head' once it 
+// got there often enough, or NULL while it is interpreted.
+JitLoop*
+jit_hot_loop(JitState* jit, const Program* program, uint32_t head) {
+    if(jit->loops[head] || jit->hits[head] == JIT_REJECTED) return jit->loops[head];
+    if(++jit->hits[head] < JIT_HOT_LOOP) return NULL;
+    jit->loops[head] = jit_compile_loop(program, head);
+    if(jit->loops[head]) {
+        jit->loops_compiled++;
+    } else {
+        jit->hits[head] = JIT_REJECTED;
+    }
+    return jit->loops[head];
+}
+
+// Runs a compiled loop from its condition on and leaves the state at the
+// token the interpreter continues with. The registers of exec_program have
+// to be saved before.
+void
+jit_run_loop(ProgramState* state, JitLoop* loop) {
+    while((uint32_t)state->stack_size + loop->max_depth >= state->stack_cap) grow_stack(state);
+    uint32_t index = state->stackframe_index;
+    JitFrame frame = { .state = state, .stackframe = state->stackframe, 
+                       .stack = state->stack + state->stack_size + 1 };
+    union { void* data; JitFunction run; } code = { loop->code };
+    const JitExit* exit = &loop->exits[code.run(&frame)];
+
+    state->stack_size += exit->depth;
+    state->stackframe_index = index + exit->nest;
+    for(uint32_t i = 0; i < exit->decl_count; i++) {
+        const JitDecl* decl = &loop->decls[exit->first_decl + i];
+        state->stackframe_depths[decl->slot] = index + decl->nest;
+        state->stackframe_size = decl->slot + 1;
+    }
+    state->inst_ptr = exit->ip;
+    if(exit->early) {
+        state->jit->early_exits++;
+        state->jit->loops[loop->head] = NULL;
+        state->jit->hits[loop->head] = JIT_REJECTED;
+        jit_free_loop(loop);
+    }
+}
+
+void
+free_jit(JitState* jit, uint32_t size) {
+    for(uint32_t i = 0; i < size; i++) {
+        if(jit->loops[i]) jit_free_loop(jit->loops[i]);
+    }
+    free(jit->loops);
+    free(jit->hits);
+}
+#endif
+
+#ifdef LANTERN_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() state->inst_count++
+#else
+#define COUNT_INSTRUCTION()
+#endif
+
+#ifdef LANTERN_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define CASE(inst) op_##inst
+#define DISPATCH() { COUNT_INSTRUCTION(); goto *handlers[insts[ip]]; }
+#else
+#define CASE(inst) case inst
+#define DISPATCH() { COUNT_INSTRUCTION(); goto dispatch; }
+#endif
+#define NEXT() { ip++; DISPATCH(); }
+
+// Charges the cycles since the previous dispatch to the instruction that
+// ran in between and counts the one about to run.
+#define PROFILE_INSTRUCTION() {                                                         \
+    uint64_t now = read_cycles();                                                       \
+    profile->cycles[profile_ip] += now - profile_start;                                 \
+    profile->counts[ip]++;                                                              \
+    profile_ip = ip;                                                                    \
+    profile_start = now;                                                                \
+}                                                                                       \
+
+// The interpreter keeps the instruction pointer, the stack pointer and the
+// top of the stack in locals. 'sp' points at the slot of the top value, 
+// whose memory copy is stale while 'tos' holds it; every value below it is
+// in memory. stack[0] is a scratch slot, so pushing onto an empty stack 
+// needs no special case.
+#define STACK_SIZE() ((int32_t)(sp - state->stack))
+#define PUSH(val) { *sp++ = tos; tos = (val); }
+// Only handlers that leave the stack deeper than they found it make room
+// before pushing.
+#define RESERVE_STACK() {                                                               \
+    if(sp == stack_end) {                                                               \
+        SAVE_REGISTERS();                                                               \
+        grow_stack(state);                                                              \
+        sp = state->stack + state->stack_size;                                          \
+        stack_end = state->stack + state->stack_cap - 1;                                \
+    }                                                                                   \
+}                                                                                       \
+
+#define DROP() { tos = *--sp; }
+#define SAVE_REGISTERS() {                                                              \
+    *sp = tos;                                                                          \
+    state->stack_size = STACK_SIZE();                                                   \
+    state->inst_ptr = ip;                                                               \
+}                                                                                       \
+
+// Errors are printed through stdio, so the program's own output is written
+// out first to keep the two in order. Output that goes to a sink gets the
+// error as well, so it stays with the run that failed.
+#define RUNTIME_ERR(cond, err_type, ...) {                                              \
+    if(cond) {                                                                          \
+        flush_output(state);                                                            \
+        if(state->output_sink) {                                                        \
+            sink_error(state, #err_type, err_type, __VA_ARGS__);                        \
+        } else {                                                                        \
+            PANIC_ON_ERR(true, err_type, __VA_ARGS__);                                  \
+            fflush(stdout);                                                             \
+        }                                                                               \
+    }                                                                                   \
+}                                                                                       \
+
+// Stops the program on errors it cannot continue from.
+#define FAIL_ON_ERR(cond, err_type, ...) {                                              \
+    if(cond) {                                                                          \
+        RUNTIME_ERR(true, err_type, __VA_ARGS__);                                       \
+        SAVE_REGISTERS();                                                               \
+        return false;                                                                   \
+    }                                                                                   \
+}                                                                                       \
+
+// Checks the operands of the instruction about to run against its stack
+// effect. Only programs the verifier could not prove run this.
+#define CHECK_OPERANDS() {                                                              \
+    const StackEffect* effect = &stack_effects[insts[ip]];                              \
+    FAIL_ON_ERR(STACK_SIZE() < effect->pops, ERR_STACK_UNDERFLOW,                       \
+                "Too few values on the stack for '%s'.", inst_names[insts[ip]]);        \
+    RuntimeValue below = effect->pops > 1 ? sp[-1] : value_int(0);                      \
+    FAIL_ON_ERR(!operands_match(effect->rule, tos, below), ERR_INVALID_DATA_TYPE,       \
+                "Invalid data types for '%s'.", inst_names[insts[ip]]);                 \
+}                                                                                       \
+
+// + == and != rewrite themselves on their first run into the form for the
+// operand types they see. The operand of the token, unused otherwise, is
+// set once a form was rewritten back, which keeps the token generic. 
+// Workers of pwhile loops share the instructions and leave them generic.
+#define QUICKEN(inst) {                                                                 \
+    if(!operands[ip] && !state->pwhile) {                                               \
+        insts[ip] = (inst);                                                             \
+        state->specializations++;                                                       \
+    }                                                                                   \
+}                                                                                       \
+
+// Verified and checked programs both guarantee operands of the same type,
+// so the forms only guard the top of the stack.
+#define DEOPTIMIZE_UNLESS(cond, generic) {                                              \
+    if(!(cond)) {                                                                       \
+        insts[ip] = (generic);                                                          \
+        operands[ip] = 1;                                                               \
+        state->deoptimizations++;                                                       \
+        DISPATCH();                                                                     \
+    }                                                                                   \
+}                                                                                       \
+
+// Ints wrap around, so + - and * are done on uint32_t like fold_constants
+// does them.
+#define INT_BINARY_OP(expr) {                                                           \
+    int32_t a = value_payload(tos);                                                     \
+    int32_t b = value_payload(*--sp);                                                   \
+    tos = value_int(expr);                                                              \
+}                                                                                       \
+
+// pwhile splits its range into one run of iterations per thread. Each 
+// worker has a state of its own that shares the heap with the state that
+// reached the loop, with its own stack and a copy of the stackframe, and 
+// every iteration starts with its index as the only value on the stack. 
+// The verifier keeps the body from allocating, printing and assigning the
+// variables outside of the loop, so workers only write to blocks. Ranges
+// too short to give every thread PWHILE_MIN_ITERATIONS use fewer threads,
+// and a single worker runs the whole range in order on the calling thread.
+#define PWHILE_MIN_ITERATIONS 1024
+
+typedef struct PWhileWorker {
+    ProgramState state;
+    const Program* program;
+    uint32_t head;
+    Instruction reduction;
+    int32_t index;
+    int32_t last;
+    // The stackframe every iteration starts from.
+    uint32_t frame_size;
+    uint32_t frame_index;
+    // The reduction of the iterations the worker ran.
+    int32_t result;
+    bool has_result;
+    bool ok;
+    // The error that stopped the worker, as it is printed.
+    char* error;
+    size_t error_size;
+} PWhileWorker;
+
+bool exec_program(ProgramState* state, const Program* program);
+
+void
+collect_pwhile_error(void* context, const char* data, size_t size) {
+    PWhileWorker* worker = context;
+    if(!size) return;
+    worker->error = realloc(worker->error, worker->error_size + size);
+    if(!worker->error) out_of_memory(&worker->state, worker->error_size + size);
+    memcpy(worker->error + worker->error_size, data, size);
+    worker->error_size += size;
+}
+
+int32_t
+reduce_ints(Instruction reduction, int32_t a, int32_t b) {
+    switch(reduction) {
+        case INST_MIN: return a < b ? a : b;
+        case INST_MAX: return a > b ? a : b;
+        default:       return (uint32_t)a + (uint32_t)b;
+    }
+}
+
+// Sets the state of a worker up for its iteration at 'index'.
+void
+start_pwhile_iteration(PWhileWorker* worker) {
+    ProgramState* state = &worker->state;
+    state->stack[1] = value_int(worker->index);
+    state->stack_size = 1;
+    state->stackframe_size = worker->frame_size;
+    state->stackframe_index = worker->frame_index;
+    state->inst_ptr = worker->head + 1;
+}
+
+// Reduces the result of the iteration that just ended and starts the next 
+// one, returns false once the worker ran its whole range.
+bool
+next_pwhile_iteration(PWhileWorker* worker) {
+    ProgramState* state = &worker->state;
+    if(worker->reduction) {
+        int32_t val = value_payload(state->stack[1]);
+        worker->result = worker->has_result ? reduce_ints(worker->reduction, worker->result, val) : val;
+        worker->has_result = true;
+    }
+    if(++worker->index >= worker->last) return false;
+    start_pwhile_iteration(worker);
+    return true;
+}
+
+void*
+run_pwhile_worker(void* arg) {
+    PWhileWorker* worker = arg;
+    worker->ok = true;
+    if(worker->index >= worker->last) return NULL;
+    start_pwhile_iteration(worker);
+    // Iterations follow each other at the end of the loop, so this returns
+    // after the last one.
+    worker->ok = exec_program(&worker->state, worker->program);
+    return NULL;
+}
+
+// Runs the iterations 'lo' to 'hi' - 1 of the pwhile loop at 'head' and 
+// stores the reduction of their results in 'result'. Returns false after
+// reporting the error of the first iteration that failed.
+bool
+run_pwhile(ProgramState* state, const Program* program, uint32_t head, int32_t lo, int32_t hi, 
+           RuntimeValue* result) {
+    Instruction reduction = PWHILE_REDUCTION(program->operands[program->operands[head] - 1]);
+    int64_t count = hi > lo ? (int64_t)hi - lo : 0;
+    uint32_t thread_count = state->threads > 1 ? state->threads : 1;
+    if(count / PWHILE_MIN_ITERATIONS < thread_count) 
+        thread_count = count / PWHILE_MIN_ITERATIONS > 1 ? count / PWHILE_MIN_ITERATIONS : 1;
+
+    PWhileWorker* workers = calloc(thread_count, sizeof(PWhileWorker));
+    if(!workers) out_of_memory(state, sizeof(PWhileWorker) * thread_count);
+    for(uint32_t t = 0; t < thread_count; t++) {
+        PWhileWorker* worker = &workers[t];
+        ProgramState* worker_state = &worker->state;
+        // Each worker is held to the budget from what the script uses so far.
+        *worker_state = (ProgramState){ 
+            .memory_limit = state->memory_limit, .memory_used = state->memory_used,
+            .heap = state->heap, .heap_size = state->heap_size, .heap_cap = state->heap_cap,
+            .program_size = state->program_size, .check_bounds = state->check_bounds, 
+            .output_sink = collect_pwhile_error, .output_context = worker, .threads = 1, .pwhile = worker };
+        grow_stack(worker_state);
+        reserve_stackframe(worker_state, program->frame_slots);
+        memcpy(worker_state->stackframe, state->stackframe, sizeof(RuntimeValue) * state->stackframe_size);
+        memcpy(worker_state->stackframe_depths, state->stackframe_depths, sizeof(uint32_t) * state->stackframe_size);
+        worker->program = program;
+        worker->head = head;
+        worker->reduction = reduction;
+        worker->frame_size = state->stackframe_size;
+        worker->frame_index = state->stackframe_index + 1;
+        worker->index = lo + count * t / thread_count;
+        worker->last = lo + count * (t + 1) / thread_count;
+    }
+    // Workers whose thread cannot be started run after the first one.
+    pthread_t* threads = malloc(sizeof(pthread_t) * thread_count);
+    uint32_t started = 1;
+    while(threads && started < thread_count && pthread_create(&threads[started], NULL, run_pwhile_worker, &workers[started]) == 0)
+        started++;
+    run_pwhile_worker(&workers[0]);
+    for(uint32_t t = started; t < thread_count; t++) run_pwhile_worker(&workers[t]);
+    for(uint32_t t = 1; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+
+    // The ranges are in order, so the first worker that failed ran the 
+    // first iteration that failed.
+    bool ok = true;
+    bool has_result = false;
+    int32_t reduced = 0;
+    for(uint32_t t = 0; t < thread_count; t++) {
+        PWhileWorker* worker = &workers[t];
+        if(ok && !worker->ok) {
+            flush_output(state);
+            write_output(state, worker->error, worker->error_size);
+            ok = false;
+        }
+        if(worker->has_result) {
+            reduced = has_result ? reduce_ints(reduction, reduced, worker->result) : worker->result;
+            has_result = true;
+        }
+        state->inst_count += worker->state.inst_count;
+        if(worker->state.memory_peak > state->memory_peak) state->memory_peak = worker->state.memory_peak;
+        free(worker->state.stack);
+        free(worker->state.stackframe);
+        free(worker->state.stackframe_depths);
+        free(worker->error);
+    }
+    free(workers);
+    if(ok && !has_result && (reduction == INST_MIN || reduction == INST_MAX)) {
+        RUNTIME_ERR(true, ERR_OUT_OF_BOUNDS, "Minimum or maximum of an empty range.");
+        ok = false;
+    }
+    *result = value_int(reduced);
+    return ok;
+}
+
+bool 
+exec_program(ProgramState* state, const Program* program) {
+    uint8_t* insts = program->insts;
+    RuntimeValue* operands = program->operands;
+    uint32_t ip = state->inst_ptr;
+    RuntimeValue* sp = state->stack + state->stack_size;
+    RuntimeValue* stack_end = state->stack + state->stack_cap - 1;
+    RuntimeValue tos = *sp;
+    Profile* profile = state->profile;
+    uint32_t profile_ip = ip;
+    uint64_t profile_start = profile ? read_cycles() : 0;
+#ifdef LANTERN_COMPUTED_GOTO
+    static void* dispatch_table[INST_COUNT] = {
+        [INST_STACK_PUSH] = &&op_INST_STACK_PUSH, [INST_STACK_PREV] = &&op_INST_STACK_PREV,
+        [INST_PLUS] = &&op_INST_PLUS, [INST_MINUS] = &&op_INST_MINUS, [INST_MUL] = &&op_INST_MUL,
+        [INST_DIV] = &&op_INST_DIV, [INST_MOD] = &&op_INST_MOD,
+        [INST_EQ] = &&op_INST_EQ, [INST_NEQ] = &&op_INST_NEQ,
+        [INST_GT] = &&op_INST_GT, [INST_LT] = &&op_INST_LT, [INST_GEQ] = &&op_INST_GEQ, [INST_LEQ] = &&op_INST_LEQ,
+        [INST_LOGICAL_AND] = &&op_INST_LOGICAL_AND, [INST_LOGICAL_OR] = &&op_INST_LOGICAL_OR,
+        [INST_IF] = &&op_INST_IF, [INST_ELSE] = &&op_INST_ELSE, [INST_ELIF] = &&op_INST_ELIF,
+        [INST_THEN] = &&op_INST_THEN, [INST_ENDIF] = &&op_INST_ENDIF,
+        [INST_WHILE] = &&op_INST_WHILE, [INST_RUN_WHILE] = &&op_INST_RUN_WHILE, [INST_END_WHILE] = &&op_INST_END_WHILE,
+        [INST_PWHILE] = &&op_INST_PWHILE, [INST_END_PWHILE] = &&op_INST_END_PWHILE,
+        [INST_PRINT] = &&op_INST_PRINT, [INST_PRINTLN] = &&op_INST_PRINTLN,
+        [INST_JUMP] = &&op_INST_JUMP,
+        [INST_ADD_VAR_TO_STACKFRAME] = &&op_INST_ADD_VAR_TO_STACKFRAME, [INST_ASSIGN] = &&op_INST_ASSIGN,
+        [INST_VAR_USAGE] = &&op_INST_VAR_USAGE, [INST_VAR_REASSIGN] = &&op_INST_VAR_REASSIGN,
+        [INST_HEAP_ALLOC] = &&op_INST_HEAP_ALLOC, [INST_HEAP_FREE] = &&op_INST_HEAP_FREE,
+        [INST_PTR_GET_I] = &&op_INST_PTR_GET_I, [INST_PTR_SET_I] = &&op_INST_PTR_SET_I,
+        [INST_INT_TYPE] = &&op_INST_INT_TYPE, [INST_STR_TYPE] = &&op_INST_STR_TYPE,
+        [INST_VAR_ADD_CONST] = &&op_INST_VAR_ADD_CONST, [INST_VAR_SUB_CONST] = &&op_INST_VAR_SUB_CONST,
+        [INST_VAR_MOD_CONST_CMP_CONST] = &&op_INST_VAR_MOD_CONST_CMP_CONST,
+        [INST_VAR_CMP_CONST_RUN] = &&op_INST_VAR_CMP_CONST_RUN, [INST_VAR_CMP_CONST_IF] = &&op_INST_VAR_CMP_CONST_IF,
+        [INST_VAR_PGET] = &&op_INST_VAR_PGET, [INST_VAR_PSET] = &&op_INST_VAR_PSET,
+        [INST_FILL] = &&op_INST_FILL, [INST_COPY] = &&op_INST_COPY, [INST_COMPARE] = &&op_INST_COMPARE,
+        [INST_SUM] = &&op_INST_SUM, [INST_MIN] = &&op_INST_MIN, [INST_MAX] = &&op_INST_MAX, 
+        [INST_SORT] = &&op_INST_SORT,
+        [INST_PLUS_INT] = &&op_INST_PLUS_INT, [INST_PLUS_STR] = &&op_INST_PLUS_STR,
+        [INST_EQ_INT] = &&op_INST_EQ_INT, [INST_EQ_STR] = &&op_INST_EQ_STR,
+        [INST_NEQ_INT] = &&op_INST_NEQ_INT, [INST_NEQ_STR] = &&op_INST_NEQ_STR,
+        [INST_HALT] = &&op_INST_HALT
+    };
+    // Profiling and checking route every dispatch through their own label 
+    // first, so the regular table pays nothing for them.
+    void* check_table[INST_COUNT];
+    void* profile_table[INST_COUNT];
+    void* const* handlers = dispatch_table;
+#ifdef LANTERN_JIT
+    // Loops are entered at their condition, from the while or after an 
+    // iteration, where they may continue in compiled code.
+    void* jit_table[INST_COUNT];
+    if(state->jit && program->verified) {
+        memcpy(jit_table, dispatch_table, sizeof(jit_table));
+        jit_table[INST_WHILE] = &&jit_while;
+        jit_table[INST_END_WHILE] = &&jit_end_while;
+        handlers = jit_table;
+    }
+#endif
+    if(!program->verified) {
+        for(uint32_t i = 0; i < INST_COUNT; i++) check_table[i] = &&check_operands;
+        handlers = check_table;
+    }
+    if(profile) {
+        for(uint32_t i = 0; i < INST_COUNT; i++) profile_table[i] = &&profile_instruction;
+        handlers = profile_table;
+    }
+    DISPATCH();
+profile_instruction:
+    PROFILE_INSTRUCTION();
+    if(program->verified) goto *dispatch_table[insts[ip]];
+check_operands:
+    CHECK_OPERANDS();
+    goto *dispatch_table[insts[ip]];
+#else
+    bool checked = !program->verified;
+#ifdef LANTERN_JIT
+    bool jit_loops = state->jit && program->verified;
+#endif
+dispatch:
+    if(profile) PROFILE_INSTRUCTION();
+    if(checked) CHECK_OPERANDS();
+#ifdef LANTERN_JIT
+    if(jit_loops && insts[ip] == INST_WHILE) goto jit_while;
+    if(jit_loops && insts[ip] == INST_END_WHILE) goto jit_end_while;
+#endif
+    switch(insts[ip]) {
+#endif
+    CASE(INST_RUN_WHILE): {
+        int32_t cond = value_payload(tos);
+        DROP();
+        if(!cond) {
+            ip = operands[ip];
+            DISPATCH();
+        }
+        state->stackframe_index++;
+        NEXT();
+    }
+    CASE(INST_END_WHILE): {
+        clear_current_stackframe(state);
+        ip = operands[ip];
+        DISPATCH();
+    }
+    CASE(INST_PWHILE): {
+        // lo hi pwhile, which the verifier proves are all that is on the stack
+        int32_t hi = value_payload(tos);
+        int32_t lo = value_payload(*--sp);
+        tos = *--sp;
+        SAVE_REGISTERS();
+        RuntimeValue result;
+        if(!run_pwhile(state, program, ip, lo, hi, &result)) return false;
+        if(PWHILE_REDUCTION(operands[operands[ip] - 1])) {
+            RESERVE_STACK();
+            PUSH(result);
+        }
+        ip = operands[ip];
+        DISPATCH();
+    }
+    CASE(INST_END_PWHILE): {
+        // The end of an iteration, the worker running it goes on with its 
+        // next one.
+        SAVE_REGISTERS();
+        if(!next_pwhile_iteration(state->pwhile)) return true;
+        ip = state->inst_ptr;
+        sp = state->stack + state->stack_size;
+        tos = *sp;
+        DISPATCH();
+    }
+    CASE(INST_VAR_USAGE): 
+    var_usage: {
+        RESERVE_STACK();
+        PUSH(state->stackframe[operands[ip]]);
+        NEXT();
+    }
+    CASE(INST_ADD_VAR_TO_STACKFRAME): {
+        uint32_t slot = operands[ip];
+        state->stackframe[slot] = tos;
+        state->stackframe_depths[slot] = state->stackframe_index;
+        state->stackframe_size = slot + 1;
+        DROP();
+        NEXT();
+    }
+    CASE(INST_VAR_REASSIGN): {
+        state->stackframe[operands[ip]] = tos;
+        DROP();
+        NEXT();
+    }
+    CASE(INST_STACK_PUSH): {
+        RESERVE_STACK();
+        PUSH(operands[ip]);
+        NEXT();
+    }
+    CASE(INST_PLUS): {
+        bool is_int = value_type(tos) == VAR_TYPE_INT;
+        QUICKEN(is_int ? INST_PLUS_INT : INST_PLUS_STR);
+        if(!is_int) goto plus_str;
+        INT_BINARY_OP((uint32_t)b + (uint32_t)a);
+        NEXT();
+    }
+    CASE(INST_PLUS_INT): {
+        DEOPTIMIZE_UNLESS(value_type(tos) == VAR_TYPE_INT, INST_PLUS);
+        INT_BINARY_OP((uint32_t)b + (uint32_t)a);
+        NEXT();
+    }
+    CASE(INST_PLUS_STR): 
+    plus_str: {
+        DEOPTIMIZE_UNLESS(value_type(tos) == VAR_TYPE_STR, INST_PLUS);
+        // Collect while both operands are still on the stack.
+        if(state->gc_allocated >= state->gc_threshold) {
+            SAVE_REGISTERS();
+            collect_garbage(state);
+        }
+        HeapValue* str_a = heap_get(state, tos);
+        HeapValue* str_b = heap_get(state, *--sp);
+        FAIL_ON_ERR(!str_a || !str_b, ERR_INVALID_PTR, "Concatenating a freed string.");
+        tos = value_str(concat_strings(state, str_b->data, str_a->data));
+        NEXT();
+    }
+    CASE(INST_MINUS):
+    CASE(INST_MUL): {
+        switch(insts[ip]) {
+            case INST_MINUS: INT_BINARY_OP((uint32_t)b - (uint32_t)a); break;
+            default:         INT_BINARY_OP((uint32_t)b * (uint32_t)a); break;
+        }
+        NEXT();
+    }
+    CASE(INST_DIV):
+    CASE(INST_MOD): {
+        FAIL_ON_ERR(value_payload(tos) == 0, ERR_DIVISION_BY_ZERO, "Division by zero.");
+        INT_BINARY_OP(divide_ints(insts[ip], b, a));
+        NEXT();
+    }
+    CASE(INST_PRINT):
+    CASE(INST_PRINTLN): {
+        FAIL_ON_ERR(!print_value(state, tos, insts[ip] == INST_PRINTLN), ERR_INVALID_PTR,
+                    "Printing a freed value.");
+        DROP();
+        NEXT();
+    }
+    CASE(INST_JUMP): {
+        int32_t index = value_payload(tos);
+        DROP();
+        FAIL_ON_ERR(index >= (int32_t)program->size || 
+                    index < 0, ERR_INVALID_JUMP, "Invalid index for jump specified.");
+        ip = index;
+        DISPATCH();
+    }
+    CASE(INST_STACK_PREV): {
+        DROP();
+        int32_t index = (STACK_SIZE() - 1) - operands[ip];
+        // The value may be the cached top, so spill it before reading.
+        *sp = tos;
+        PUSH(state->stack[index + 1]);
+        NEXT();
+    }
+    CASE(INST_EQ):
+    CASE(INST_NEQ): {
+        bool negate = insts[ip] == INST_NEQ;
+        if(value_type(tos) == VAR_TYPE_INT) {
+            QUICKEN(negate ? INST_NEQ_INT : INST_EQ_INT);
+            INT_BINARY_OP((a == b) != negate);
+        } else {
+            QUICKEN(negate ? INST_NEQ_STR : INST_EQ_STR);
+            // Interned strings are equal exactly when their handles are.
+            RuntimeValue b = *--sp;
+            tos = value_int((tos == b) != negate);
+        }
+        NEXT();
+    }
+    CASE(INST_EQ_INT):
+    CASE(INST_NEQ_INT): {
+        bool negate = insts[ip] == INST_NEQ_INT;
+        DEOPTIMIZE_UNLESS(value_type(tos) == VAR_TYPE_INT, negate ? INST_NEQ : INST_EQ);
+        INT_BINARY_OP((a == b) != negate);
+        NEXT();
+    }
+    CASE(INST_EQ_STR):
+    CASE(INST_NEQ_STR): {
+        bool negate = insts[ip] == INST_NEQ_STR;
+        DEOPTIMIZE_UNLESS(value_type(tos) == VAR_TYPE_STR, negate ? INST_NEQ : INST_EQ);
+        RuntimeValue b = *--sp;
+        tos = value_int((tos == b) != negate);
+        NEXT();
+    }
+    CASE(INST_GT): {
+        INT_BINARY_OP(b > a);
+        NEXT();
+    }
+    CASE(INST_LT): {
+        INT_BINARY_OP(b < a);
+        NEXT();
+    }
+    CASE(INST_GEQ): {
+        INT_BINARY_OP(b >= a);
+        NEXT();
+    }
+    CASE(INST_LEQ): {
+        INT_BINARY_OP(b <= a);
+        NEXT();
+    }
+    CASE(INST_LOGICAL_OR): {
+        INT_BINARY_OP(b || a);
+        NEXT();
+    }
+    CASE(INST_LOGICAL_AND): {
+        INT_BINARY_OP(b && a);
+        NEXT();
+    }
+    CASE(INST_ELIF):
+    CASE(INST_ELSE): {
+        // Reached when the branch before it has finished.
+        ip = operands[ip];
+        DISPATCH();
+    }
+    CASE(INST_ENDIF): {
+        clear_current_stackframe(state);
+        NEXT();
+    }
+    CASE(INST_IF):
+    CASE(INST_THEN): {
+        // The whole if chain shares one stackframe, entered at the if and 
+        // left at the endif.
+        if(insts[ip] == INST_IF)
+            state->stackframe_index++;
+        int32_t cond = value_payload(tos);
+        DROP();
+        if(!cond) {
+            ip = operands[ip];
+            DISPATCH();
+        }
+        NEXT();
+    }
+    CASE(INST_HEAP_ALLOC): {
+        FAIL_ON_ERR(value_payload(tos) < 0, ERR_INVALID_DATA_TYPE, "Invalid length for allocating block.");
+        // The type word before alloc carries the element type.
+        tos = value_ptr(alloc_block(state, value_payload(tos), operands[ip - 1]));
+        NEXT();
+    }
+    CASE(INST_HEAP_FREE): {
+        FAIL_ON_ERR(!value_is_heap(tos), ERR_INVALID_PTR, "Trying to free stack based value.");
+        HeapValue* slot = heap_get(state, tos);
+        // Strings are interned and collected, only allocated blocks are freed.
+        FAIL_ON_ERR(!slot || slot->kind != HEAP_SLOT_BLOCK, ERR_INVALID_PTR, "Invalid pointer for free.");
+
+        heap_free(state, slot);
+        DROP();
+        NEXT();
+    }
+    CASE(INST_FILL): {
+        // value start count ptr fill
+        HeapValue* block;
+        void* data = block_range(state, sp[-2], sp[-1], tos, &block);
+        FAIL_ON_ERR(!data, ERR_INVALID_PTR, "Invalid range for fill.");
+        RuntimeValue val = sp[-3];
+        FAIL_ON_ERR(value_type(val) != elem_var_type(block->elem_type), ERR_INVALID_DATA_TYPE, 
+                    "Filling block with value of different data type.");
+        int64_t element = block->elem_type == ELEM_STR ? (int64_t)val : value_payload(val);
+        range_kernels[block->elem_type].fill(data, value_payload(sp[-1]), element);
+        sp -= 4;
+        tos = *sp;
+        NEXT();
+    }
+    CASE(INST_COPY):
+    CASE(INST_COMPARE): {
+        // start count src dst_start dst copy|compare
+        HeapValue* src_block;
+        HeapValue* dst_block;
+        void* src = block_range(state, sp[-4], sp[-3], sp[-2], &src_block);
+        void* dst = block_range(state, sp[-1], sp[-3], tos, &dst_block);
+        FAIL_ON_ERR(!src || !dst, ERR_INVALID_PTR, "Invalid range for copy or compare.");
+        FAIL_ON_ERR(src_block->elem_type != dst_block->elem_type, ERR_INVALID_DATA_TYPE, 
+                    "Blocks of different data types.");
+        uint32_t count = value_payload(sp[-3]);
+        if(insts[ip] == INST_COPY) {
+            memmove(dst, src, (size_t)count * elem_width(src_block->elem_type));
+            sp -= 5;
+            tos = *sp;
+        } else {
+            FAIL_ON_ERR(src_block->elem_type == ELEM_STR, ERR_INVALID_DATA_TYPE, "Comparing blocks of strings.");
+            int32_t result = range_kernels[src_block->elem_type].compare(src, dst, count);
+            sp -= 4;
+            tos = value_int(result);
+        }
+        NEXT();
+    }
+    CASE(INST_SUM):
+    CASE(INST_MIN):
+    CASE(INST_MAX):
+    CASE(INST_SORT): {
+        // start count ptr sum|min|max|sort
+        HeapValue* block;
+        void* data = block_range(state, sp[-2], sp[-1], tos, &block);
+        FAIL_ON_ERR(!data, ERR_INVALID_PTR, "Invalid range for block operation.");
+        FAIL_ON_ERR(block->elem_type == ELEM_STR, ERR_INVALID_DATA_TYPE, "Block operation on block of strings.");
+        const RangeKernels* kernels = &range_kernels[block->elem_type];
+        uint32_t count = value_payload(sp[-1]);
+        FAIL_ON_ERR(count == 0 && (insts[ip] == INST_MIN || insts[ip] == INST_MAX), ERR_OUT_OF_BOUNDS, 
+                    "Minimum or maximum of an empty range.");
+        switch(insts[ip]) {
+            case INST_SUM: tos = value_int(kernels->sum(data, count)); break;
+            case INST_MIN: tos = value_int(kernels->min(data, count)); break;
+            case INST_MAX: tos = value_int(kernels->max(data, count)); break;
+            default:       kernels->sort(state, data, count); break;
+        }
+        if(insts[ip] == INST_SORT) {
+            sp -= 3;
+            tos = *sp;
+        } else {
+            sp -= 2;
+        }
+        NEXT();
+    }
+    CASE(INST_PTR_GET_I): {
+        RuntimeValue heap_index = tos;
+        RuntimeValue data_index = *--sp;
+        FAIL_ON_ERR(!value_is_heap(heap_index), ERR_INVALID_PTR, "Trying to pget with stack based value.");
+        HeapValue* block = heap_get(state, heap_index);
+        FAIL_ON_ERR(!block || block->kind != HEAP_SLOT_BLOCK, ERR_INVALID_PTR, "Invalid pointer for pget.");
+        uint32_t index = value_payload(data_index);
+        FAIL_ON_ERR(state->check_bounds && index >= block_length(block), ERR_OUT_OF_BOUNDS, 
+                    "Index %i out of bounds for pget on block of length %u.", (int32_t)index, block_length(block));
+
+        if(block->elem_type == ELEM_STR) {
+            tos = ((RuntimeValue*)block->data)[index];
+        } else {
+            tos = value_int(block_get_int(block, index));
+        }
+        NEXT();
+    } 
+    CASE(INST_PTR_SET_I): {
+        RuntimeValue heap_index = tos;
+        RuntimeValue data_index = *--sp;
+        RuntimeValue val = *--sp;
+        tos = *--sp;
+
+        FAIL_ON_ERR(!value_is_heap(heap_index), ERR_INVALID_PTR, "Trying to pset with stack based value.");
+        HeapValue* block = heap_get(state, heap_index);
+        FAIL_ON_ERR(!block || block->kind != HEAP_SLOT_BLOCK, ERR_INVALID_PTR, "Invalid pointer for pset.");
+        FAIL_ON_ERR(value_type(val) != elem_var_type(block->elem_type), 
+            ERR_INVALID_DATA_TYPE, "Assigning value of pointer to different data type");
+        uint32_t index = value_payload(data_index);
+        FAIL_ON_ERR(state->check_bounds && index >= block_length(block), ERR_OUT_OF_BOUNDS, 
+                    "Index %i out of bounds for pset on block of length %u.", (int32_t)index, block_length(block));
+
+        if(block->elem_type == ELEM_STR) {
+            ((RuntimeValue*)block->data)[index] = val;
+        } else {
+            block_set_int(block, index, value_payload(val));
+        }
+        NEXT();
+    }
+    CASE(INST_WHILE):
+    CASE(INST_ASSIGN):
+    CASE(INST_INT_TYPE):
+    CASE(INST_STR_TYPE): {
+        NEXT();
+    }
+    CASE(INST_VAR_ADD_CONST):
+    CASE(INST_VAR_SUB_CONST): {
+        // x c + = y
+        RuntimeValue val = state->stackframe[operands[ip]];
+        if(value_type(val) != VAR_TYPE_INT) goto var_usage;
+        int32_t a = value_payload(operands[ip + 1]);
+        int32_t b = value_payload(val);
+        state->stackframe[operands[ip + 4]] = value_int(insts[ip] == INST_VAR_ADD_CONST ? (uint32_t)b + (uint32_t)a 
+                                                                                         : (uint32_t)b - (uint32_t)a);
+        ip += 5;
+        DISPATCH();
+    }
+    CASE(INST_VAR_MOD_CONST_CMP_CONST): {
+        // x c % k ==, for a c that % never fails or wraps on
+        RuntimeValue val = state->stackframe[operands[ip]];
+        if(value_type(val) != VAR_TYPE_INT) goto var_usage;
+        int32_t mod = value_payload(val) % value_payload(operands[ip + 1]);
+        RESERVE_STACK();
+        PUSH(value_int(compare_ints(insts[ip + 4], mod, value_payload(operands[ip + 3]))));
+        ip += 5;
+        DISPATCH();
+    }
+    CASE(INST_VAR_CMP_CONST_RUN): {
+        // x c < run
+        RuntimeValue val = state->stackframe[operands[ip]];
+        if(value_type(val) != VAR_TYPE_INT) goto var_usage;
+        if(!compare_ints(insts[ip + 2], value_payload(val), value_payload(operands[ip + 1]))) {
+            ip = operands[ip + 3];
+            DISPATCH();
+        }
+        state->stackframe_index++;
+        ip += 4;
+        DISPATCH();
+    }
+    CASE(INST_VAR_CMP_CONST_IF): {
+        // x c < if
+        RuntimeValue val = state->stackframe[operands[ip]];
+        if(value_type(val) != VAR_TYPE_INT) goto var_usage;
+        state->stackframe_index++;
+        if(!compare_ints(insts[ip + 2], value_payload(val), value_payload(operands[ip + 1]))) {
+            ip = operands[ip + 3];
+            DISPATCH();
+        }
+        ip += 4;
+        DISPATCH();
+    }
+    CASE(INST_VAR_PGET): {
+        // i ptr pget
+        HeapValue* block = heap_get(state, state->stackframe[operands[ip + 1]]);
+        uint32_t index = value_payload(state->stackframe[operands[ip]]);
+        if(!block || block->kind != HEAP_SLOT_BLOCK || block->elem_type == ELEM_STR || 
+           (state->check_bounds && index >= block_length(block))) 
+            goto var_usage;
+        RESERVE_STACK();
+        PUSH(value_int(block_get_int(block, index)));
+        ip += 3;
+        DISPATCH();
+    }
+    CASE(INST_VAR_PSET): {
+        // v i ptr pset, with v already on the stack
+        HeapValue* block = heap_get(state, state->stackframe[operands[ip + 1]]);
+        uint32_t index = value_payload(state->stackframe[operands[ip]]);
+        if(STACK_SIZE() < 1 || value_type(tos) != VAR_TYPE_INT || !block || block->kind != HEAP_SLOT_BLOCK ||
+           block->elem_type == ELEM_STR || (state->check_bounds && index >= block_length(block))) 
+            goto var_usage;
+        block_set_int(block, index, value_payload(tos));
+        DROP();
+        ip += 3;
+        DISPATCH();
+    }
+    CASE(INST_HALT): {
+        SAVE_REGISTERS();
+        return true;
+    }
+#ifdef LANTERN_JIT
+jit_while:
+    ip++;
+    goto jit_loop;
+jit_end_while:
+    clear_current_stackframe(state);
+    ip = operands[ip];
+jit_loop: {
+        JitLoop* loop = jit_hot_loop(state->jit, program, ip);
+        if(loop) {
+            SAVE_REGISTERS();
+            jit_run_loop(state, loop);
+            ip = state->inst_ptr;
+            sp = state->stack + state->stack_size;
+            stack_end = state->stack + state->stack_cap - 1;
+            tos = *sp;
+        }
+        DISPATCH();
+    }
+#endif
+#ifndef LANTERN_COMPUTED_GOTO
+    }
+    return false;
+#endif
+}
+#ifdef LANTERN_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+// Compiled programs are cached in a .lntc file next to the source (or in
+// the directory passed with --cache-dir). The file holds the resolved 
+// operand and opcode arrays exactly as exec_program consumes them, so a 
+// cache hit maps the file and executes straight out of the mapping. After
+// the header come the operands, the literal offsets, the opcodes and the
+// literal pool, which keeps every array naturally aligned.
+#define LNTC_MAGIC "LNTC"
+#define LNTC_VERSION 14
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t value_size;
     uint32_t program_size;
-    ProgramState program_state;
-    program_state.stack_size = 0;
-    program_state.heap_size = 0;
-    program_state.stackframe_size = 0;
-    program_state.inst_ptr = 0;
-    program_state.heap = malloc(1024 * 1024 /* TODO: Dynamic Heap */);
-    program_state.stackframe_index = 0;
-    Token* program = load_program_from_file(argv[1], &program_size, &program_state);
-    program_state.program_size = program_size;
-    exec_program(&program_state, program, program_size);
-    free(program_state.heap);
+    uint64_t source_hash;
+    int64_t source_mtime;
+    uint64_t source_size;
+    uint32_t literal_count;
+    uint32_t literal_pool_size;
+    uint32_t frame_slots;
+    uint32_t verified;
+} CacheHeader;
+
+typedef struct {
+    uint64_t hash;
+    int64_t mtime;
+    uint64_t size;
+} SourceInfo;
+
+bool
+get_source_info(const char* filepath, SourceInfo* info) {
+    struct stat st;
+    if(stat(filepath, &st) != 0) return false;
+    MappedFile source;
+    if(!map_file(filepath, &source)) return false;
+    info->hash = hash_bytes(source.data, source.size);
+    info->mtime = (int64_t)st.st_mtime;
+    info->size = source.size;
+    unmap_file(&source);
+    return true;
+}
+
+void
+get_cache_path(const char* filepath, const char* cache_dir, char* cache_path, size_t cache_path_size) {
+    if(!cache_dir) {
+        const char* ext = strrchr(filepath, '.');
+        const char* sep = strrchr(filepath, '/');
+        size_t stem_len = (ext && (!sep || ext > sep)) ? (size_t)(ext - filepath) : strlen(filepath);
+        snprintf(cache_path, cache_path_size, "%.*s.lntc", (int)stem_len, filepath);
+        return;
+    }
+    // Scripts with the same name in different directories share a cache
+    // directory, so the name carries a hash of the source path.
+    const char* name = strrchr(filepath, '/');
+    name = name ? name + 1 : filepath;
+    snprintf(cache_path, cache_path_size, "%s/%s.%016llx.lntc", cache_dir, name,
+             (unsigned long long)hash_bytes(filepath, strlen(filepath)));
+}
+
+bool
+load_program_from_cache(const char* cache_path, const SourceInfo* source, Program* program,
+                        ProgramState* state, MappedFile* cache) {
+    if(!map_file(cache_path, cache)) return false;
+
+    const CacheHeader* header = cache->data;
+    if(cache->size < sizeof(*header) || memcmp(header->magic, LNTC_MAGIC, 4) != 0 ||
+       header->version != LNTC_VERSION || header->value_size != sizeof(RuntimeValue) ||
+       header->source_hash != source->hash || header->source_mtime != source->mtime ||
+       header->source_size != source->size) {
+        unmap_file(cache);
+        return false;
+    }
+    size_t token_count = (size_t)header->program_size + 1;
+    size_t tables_size = sizeof(uint32_t) * (size_t)header->literal_count;
+    if(cache->size != sizeof(*header) + token_count * (sizeof(RuntimeValue) + 1) + 
+       tables_size + header->literal_pool_size) {
+        unmap_file(cache);
+        return false;
+    }
+
+    program->operands = (RuntimeValue*)(header + 1);
+    const uint32_t* literal_offsets = (const uint32_t*)(program->operands + token_count);
+    program->insts = (uint8_t*)(literal_offsets + header->literal_count);
+    const char* literal_pool = (const char*)(program->insts + token_count);
+
+    for(uint32_t i = 0; i < header->literal_count; i++) {
+        const char* literal = literal_pool + literal_offsets[i];
+        register_literal(state, literal, strlen(literal));
+    }
+    program->size = header->program_size;
+    program->cap = 0;
+    program->frame_slots = header->frame_slots;
+    program->verified = header->verified;
+    charge_memory(state, cache->size);
+    return true;
+}
+
+void
+write_program_cache(const char* cache_path, const SourceInfo* source, const Program* program, 
+                    ProgramState* state) {
+    // Every heap slot that exists after loading is a string literal.
+    uint32_t* literal_offsets = malloc(sizeof(uint32_t) * (state->heap_size + 1));
+    uint32_t literal_pool_size = 0;
+    for(uint32_t i = 0; i < state->heap_size; i++) {
+        literal_offsets[i] = literal_pool_size;
+        literal_pool_size += ((const String*)state->heap[i].data)->len + 1;
+    }
+    CacheHeader header = {
+        .magic = LNTC_MAGIC,
+        .version = LNTC_VERSION,
+        .value_size = sizeof(RuntimeValue),
+        .program_size = program->size,
+        .source_hash = source->hash,
+        .source_mtime = source->mtime,
+        .source_size = source->size,
+        .literal_count = state->heap_size,
+        .literal_pool_size = literal_pool_size,
+        .frame_slots = program->frame_slots,
+        .verified = program->verified
+    };
+
+    // Write to a temporary file and rename it into place so concurrent runs
+    // never map a half written cache.
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache_path, (long)getpid());
+    FILE* file = fopen(tmp_path, "wb");
+    if(!file) {
+        free(literal_offsets);
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(program->operands, sizeof(RuntimeValue), program->size + 1, file) == program->size + 1 &&
+        fwrite(literal_offsets, sizeof(uint32_t), state->heap_size, file) == state->heap_size &&
+        fwrite(program->insts, 1, program->size + 1, file) == program->size + 1;
+    for(uint32_t i = 0; i < state->heap_size && ok; i++) {
+        const String* literal = state->heap[i].data;
+        ok = fwrite(literal->data, literal->len + 1, 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    if(!ok || rename(tmp_path, cache_path) != 0) 
+        remove(tmp_path);
+    free(literal_offsets);
+}
+
+// Parses a byte count with an optional K, M or G suffix.
+bool
+parse_memory_size(const char* str, size_t* size) {
+    char* end;
+    unsigned long long val = strtoull(str, &end, 10);
+    if(end == str || str[0] == '-') return false;
+    switch(toupper((unsigned char)*end)) {
+        case 'G': val *= 1024; /* fall through */
+        case 'M': val *= 1024; /* fall through */
+        case 'K': val *= 1024; end++; break;
+        default: break;
+    }
+    if(*end == 'B' || *end == 'b') end++;
+    *size = val;
+    return *end == '\0';
+}
+
+// Peak resident set size in KiB, or -1 where it cannot be read.
+long
+peak_rss_kb(void) {
+    long peak = -1;
+#ifndef _WIN32
+    FILE* file = fopen("/proc/self/status", "r");
+    if(!file) return -1;
+    char line[256];
+    while(fgets(line, sizeof(line), file)) {
+        if(sscanf(line, "VmHWM: %ld kB", &peak) == 1) break;
+    }
+    fclose(file);
+#endif
+    return peak;
+}
+
+// Processors online, or 1 where that cannot be read.
+uint32_t
+cpu_count(void) {
+    long count = 1;
+#ifndef _WIN32
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+void
+print_stats(const ProgramState* state, uint64_t load_ns, uint64_t exec_ns) {
+    fprintf(stderr, "Lantern: [Stats]: load: %.3f ms, exec: %.3f ms, peak rss: %ld KB\n",
+            load_ns / 1e6, exec_ns / 1e6, peak_rss_kb());
+#ifdef LANTERN_COUNT_INSTRUCTIONS
+    fprintf(stderr, "Lantern: [Stats]: instructions: %llu\n", (unsigned long long)state->inst_count);
+#endif
+    const GCStats* stats = &state->gc_stats;
+    fprintf(stderr, "Lantern: [Stats]: collections: %u, pause total: %.3f ms, pause max: %.3f ms\n",
+            stats->collections, stats->pause_total_ns / 1e6, stats->pause_max_ns / 1e6);
+    fprintf(stderr, "Lantern: [Stats]: strings freed: %llu, heap slots: %u, peak memory: %zu bytes\n",
+            (unsigned long long)stats->strings_freed, state->heap_size, state->memory_peak);
+    fprintf(stderr, "Lantern: [Stats]: specializations: %llu, deoptimizations: %llu\n",
+            (unsigned long long)state->specializations, (unsigned long long)state->deoptimizations);
+    if(state->jit)
+        fprintf(stderr, "Lantern: [Stats]: jit loops compiled: %u, early exits: %llu\n",
+                state->jit->loops_compiled, (unsigned long long)state->jit->early_exits);
+}
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t count;
+    uint32_t index;
+} ProfileEntry;
+
+int
+compare_profile_entries(const void* a, const void* b) {
+    uint64_t cycles_a = ((const ProfileEntry*)a)->cycles;
+    uint64_t cycles_b = ((const ProfileEntry*)b)->cycles;
+    return (cycles_a < cycles_b) - (cycles_a > cycles_b);
+}
+
+#define PROFILE_HOT_SPOTS 20
+
+void
+print_profile(const Program* program, const Profile* profile) {
+    uint64_t total_cycles = 0;
+    uint64_t total_count = 0;
+    ProfileEntry opcodes[INST_COUNT] = {0};
+    ProfileEntry* tokens = malloc(sizeof(ProfileEntry) * (program->size + 1));
+    for(uint32_t i = 0; i <= program->size; i++) {
+        tokens[i] = (ProfileEntry){ .cycles = profile->cycles[i], .count = profile->counts[i], .index = i };
+        opcodes[program->insts[i]].cycles += profile->cycles[i];
+        opcodes[program->insts[i]].count += profile->counts[i];
+        total_cycles += profile->cycles[i];
+        total_count += profile->counts[i];
+    }
+    for(uint32_t i = 0; i < INST_COUNT; i++) opcodes[i].index = i;
+    qsort(opcodes, INST_COUNT, sizeof(ProfileEntry), compare_profile_entries);
+    qsort(tokens, program->size + 1, sizeof(ProfileEntry), compare_profile_entries);
+    double percent = total_cycles ? 100.0 / total_cycles : 0.0;
+
+    fprintf(stderr, "Lantern: [Profile]: %llu cycles in %llu instructions\n", 
+            (unsigned long long)total_cycles, (unsigned long long)total_count);
+    fprintf(stderr, "\n%14s %7s %12s  %s\n", "cycles", "%", "count", "opcode");
+    for(uint32_t i = 0; i < INST_COUNT && opcodes[i].count; i++) {
+        fprintf(stderr, "%14llu %6.2f%% %12llu  %s\n", (unsigned long long)opcodes[i].cycles, 
+                opcodes[i].cycles * percent, (unsigned long long)opcodes[i].count, inst_names[opcodes[i].index]);
+    }
+    fprintf(stderr, "\n%14s %7s %12s  %-12s %s\n", "cycles", "%", "count", "line:column", "opcode");
+    for(uint32_t i = 0; i < PROFILE_HOT_SPOTS && i <= program->size && tokens[i].count; i++) {
+        const TokenPos* pos = &program->positions[tokens[i].index];
+        char location[32];
+        snprintf(location, sizeof(location), "%u:%u", pos->line, pos->column);
+        fprintf(stderr, "%14llu %6.2f%% %12llu  %-12s %s", (unsigned long long)tokens[i].cycles, 
+                tokens[i].cycles * percent, (unsigned long long)tokens[i].count, location, 
+                inst_names[program->insts[tokens[i].index]]);
+        if(pos->call) {
+            fprintf(stderr, "  in");
+            print_macro_chain(stderr, program, pos->call, " ");
+        }
+        fprintf(stderr, "\n");
+    }
+    free(tokens);
+}
+
+// Writes one line per executed token in the folded stack format read by
+// flamegraph tools: the script, the macro calls and the token, then cycles.
+bool
+write_folded_profile(const char* path, const char* script, const Program* program, const Profile* profile) {
+    FILE* file = fopen(path, "w");
+    if(!file) return false;
+    const char* name = strrchr(script, '/');
+    name = name ? name + 1 : script;
+    for(uint32_t i = 0; i <= program->size; i++) {
+        if(!profile->counts[i]) continue;
+        const TokenPos* pos = &program->positions[i];
+        fprintf(file, "%s", name);
+        print_macro_chain(file, program, pos->call, ";");
+        fprintf(file, ";%s (%u:%u) %llu\n", inst_names[program->insts[i]], pos->line, pos->column, 
+                (unsigned long long)profile->cycles[i]);
+    }
+    return fclose(file) == 0;
+}
+
+// The embedding API from lantern.h. A program owns its tokens and the 
+// strings of its literals, and VMs give those strings heap slots of their
+// own at the handles the loader gave them, so the tokens stay valid in
+// every VM without being changed.
+struct LanternProgram {
+    Program program;
+    String** literals;
+    uint32_t literal_count;
+    char* literal_pool;
+};
+
+struct LanternVM {
+    const LanternProgram* source;
+    // Quickening rewrites instructions as they run, so each VM runs its own
+    // copy of them.
+    Program program;
+    ProgramState state;
+};
+
+// Gives 'state' heap slots for literals that live outside of it, in order.
+void
+adopt_literals(ProgramState* state, String* const* literals, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        HeapValue slot = { .data = literals[i], .size = sizeof(String) + literals[i]->len + 1, 
+                           .elem_type = ELEM_STR, .kind = HEAP_SLOT_LITERAL };
+        heap_add(state, slot);
+    }
+    uint32_t bucket_count = 256;
+    while(bucket_count <= count * 2) bucket_count *= 2;
+    rebuild_string_table(state, bucket_count);
+}
+
+LanternProgram*
+lantern_compile(const char* source, size_t size, const char* name) {
+    // Literals are interned into a scratch state while loading and copied
+    // into the program afterwards. Every slot on its heap is a literal.
+    ProgramState scratch = { .gc_threshold = GC_MIN_THRESHOLD };
+    Program program;
+    if(!load_program(source, size, &program, &scratch, false)) {
+        free_program_state(&scratch);
+        return NULL;
+    }
+    crossreference_tokens(&scratch, &program);
+    VerifyResult verified = verify_program(&scratch, &program, NULL);
+    if(verified == VERIFY_FAILED) {
+        // Load the script again with source positions to report where the
+        // errors are.
+        free_program(&program);
+        load_program(source, size, &program, &scratch, true);
+        crossreference_tokens(&scratch, &program);
+        verify_program(&scratch, &program, name);
+        free_program(&program);
+        free_program_state(&scratch);
+        return NULL;
+    }
+    program.verified = verified == VERIFY_PASSED;
+    optimize_program(&program);
+
+    LanternProgram* compiled = calloc(1, sizeof(LanternProgram));
+    compiled->program = program;
+    compiled->literal_count = scratch.heap_size;
+    compiled->literals = malloc(sizeof(String*) * (scratch.heap_size + 1));
+    size_t pool_size = 0;
+    for(uint32_t i = 0; i < scratch.heap_size; i++) {
+        pool_size += (scratch.heap[i].size + 7) & ~(size_t)7;
+    }
+    compiled->literal_pool = malloc(pool_size + 1);
+    char* literal = compiled->literal_pool;
+    for(uint32_t i = 0; i < scratch.heap_size; i++) {
+        memcpy(literal, scratch.heap[i].data, scratch.heap[i].size);
+        compiled->literals[i] = (String*)literal;
+        literal += (scratch.heap[i].size + 7) & ~(size_t)7;
+    }
+    free_program_state(&scratch);
+    return compiled;
+}
+
+LanternProgram*
+lantern_compile_file(const char* path) {
+    MappedFile source;
+    if(!map_file(path, &source)) {
+        printf("Lantern: [Error]: Cannot read file '%s'.\n", path);
+        return NULL;
+    }
+    LanternProgram* program = lantern_compile(source.data, source.size, path);
+    unmap_file(&source);
+    return program;
+}
+
+void
+lantern_free_program(LanternProgram* program) {
+    if(!program) return;
+    free_program(&program->program);
+    free(program->literals);
+    free(program->literal_pool);
     free(program);
+}
+
+LanternVM*
+lantern_create_vm(const LanternProgram* program, const LanternOptions* options) {
+    LanternOptions defaults = { .output_buffer_size = 64 * 1024 };
+    if(!options) options = &defaults;
+    LanternVM* vm = calloc(1, sizeof(LanternVM));
+    vm->source = program;
+    ProgramState* state = &vm->state;
+    *state = (ProgramState){ .memory_limit = options->memory_limit, .gc_threshold = GC_MIN_THRESHOLD,
+                             .line_buffered = options->line_buffered, .check_bounds = options->check_bounds,
+                             .output_sink = options->output, .output_context = options->output_context,
+                             .threads = options->threads };
+    state->output = checked_alloc(state, NULL, options->output_buffer_size);
+    state->output_cap = options->output_buffer_size;
+    grow_stack(state);
+    reserve_stackframe(state, program->program.frame_slots);
+    state->program_size = program->program.size;
+    adopt_literals(state, program->literals, program->literal_count);
+
+    size_t token_count = program->program.size + 1;
+    vm->program = (Program){ .size = program->program.size, .frame_slots = program->program.frame_slots,
+                             .verified = program->program.verified };
+    vm->program.insts = checked_alloc(state, NULL, token_count);
+    vm->program.operands = checked_alloc(state, NULL, sizeof(RuntimeValue) * token_count);
+    memcpy(vm->program.insts, program->program.insts, token_count);
+    memcpy(vm->program.operands, program->program.operands, sizeof(RuntimeValue) * token_count);
+    return vm;
+}
+
+bool
+lantern_run(LanternVM* vm) {
+    bool ok = exec_program(&vm->state, &vm->program);
+    flush_output(&vm->state);
+    return ok;
+}
+
+void
+lantern_reset(LanternVM* vm) {
+    ProgramState* state = &vm->state;
+    for(uint32_t i = vm->source->literal_count; i < state->heap_size; i++) {
+        HeapValue* slot = &state->heap[i];
+        if(slot->kind == HEAP_SLOT_FREE) continue;
+        // Literals made at runtime stay in the arena until the VM is freed.
+        if(slot->kind == HEAP_SLOT_LITERAL) retire_slot(state, slot);
+        else heap_free(state, slot);
+    }
+    rebuild_string_table(state, state->string_bucket_count);
+    state->stack_size = 0;
+    state->stackframe_size = 0;
+    state->stackframe_index = 0;
+    state->inst_ptr = 0;
+    state->output_size = 0;
+    state->gc_allocated = 0;
+    state->gc_threshold = GC_MIN_THRESHOLD;
+    state->gc_stats = (GCStats){0};
+}
+
+void
+lantern_free_vm(LanternVM* vm) {
+    if(!vm) return;
+    free(vm->program.insts);
+    free(vm->program.operands);
+    free_program_state(&vm->state);
+    free(vm);
+}
+
+// Programs compiled to C with --emit-c link against liblantern, which is
+// lantern.c built with LANTERN_LIBRARY to leave out main. The generated 
+// code keeps ints in C locals and strings in roots that take the place of
+// the stackframe, so the collector finds them. Blocks are read and written
+// through their data, and instructions without a translation of their own
+// run through exec_program. The rt_ functions it calls are exported from
+// liblantern with LANTERN_API.
+
+// What the generated code is compiled against.
+const char* rt_declarations =
+    "typedef uint64_t RuntimeValue;\n"
+    "typedef struct ProgramState ProgramState;\n"
+    "\n"
+    "ProgramState* rt_start(uint32_t version, uint32_t roots);\n"
+    "int rt_finish(ProgramState* state);\n"
+    "RuntimeValue* rt_roots(ProgramState* state);\n"
+    "RuntimeValue rt_int(int32_t val);\n"
+    "RuntimeValue rt_literal(ProgramState* state, const char* data, uint32_t len);\n"
+    "RuntimeValue rt_concat(ProgramState* state, RuntimeValue b, RuntimeValue a);\n"
+    "void rt_print(ProgramState* state, RuntimeValue val, bool newline);\n"
+    "void rt_print_int(ProgramState* state, int32_t val, bool newline);\n"
+    "int32_t rt_divide(ProgramState* state, uint32_t inst, int32_t b, int32_t a);\n"
+    "RuntimeValue rt_alloc(ProgramState* state, int32_t length, uint32_t type);\n"
+    "void* rt_data(ProgramState* state, RuntimeValue ptr, bool set);\n"
+    "void rt_check_index(ProgramState* state, RuntimeValue ptr, int32_t index, bool set);\n"
+    "void rt_empty_range(ProgramState* state);\n"
+    "int32_t rt_run(ProgramState* state, uint32_t inst, const RuntimeValue* args, uint32_t count);\n";
+
+LANTERN_API ProgramState*
+rt_start(uint32_t version, uint32_t roots) {
+    // The generated code numbers instructions and element types the way 
+    // the interpreter that wrote it did.
+    if(version != LNTC_VERSION) {
+        printf("Lantern: [Error]: Program was compiled by another version of Lantern.\n");
+        exit(1);
+    }
+    ProgramState* state = calloc(1, sizeof(ProgramState));
+    state->gc_threshold = GC_MIN_THRESHOLD;
+    state->line_buffered = isatty(STDOUT_FILENO);
+    state->output_cap = 64 * 1024;
+    state->output = checked_alloc(state, NULL, state->output_cap);
+    grow_stack(state);
+    reserve_stackframe(state, roots);
+    for(uint32_t i = 0; i < roots; i++) state->stackframe[i] = value_int(0);
+    state->stackframe_size = roots;
+    return state;
+}
+
+LANTERN_API int
+rt_finish(ProgramState* state) {
+    flush_output(state);
+    free_program_state(state);
+    free(state);
     return 0;
-} 
+}
+
+// Ends the program after an error was reported.
+void
+rt_fail(ProgramState* state) {
+    free_program_state(state);
+    free(state);
+    exit(1);
+}
+
+LANTERN_API RuntimeValue*
+rt_roots(ProgramState* state) {
+    return state->stackframe;
+}
+
+LANTERN_API RuntimeValue
+rt_int(int32_t val) {
+    return value_int(val);
+}
+
+LANTERN_API RuntimeValue
+rt_literal(ProgramState* state, const char* data, uint32_t len) {
+    return value_str(register_literal(state, data, len));
+}
+
+LANTERN_API RuntimeValue
+rt_concat(ProgramState* state, RuntimeValue b, RuntimeValue a) {
+    // Both operands are roots, so they survive the collection.
+    if(state->gc_allocated >= state->gc_threshold) 
+        collect_garbage(state);
+    HeapValue* str_b = heap_get(state, b);
+    HeapValue* str_a = heap_get(state, a);
+    if(!str_a || !str_b) {
+        RUNTIME_ERR(true, ERR_INVALID_PTR, "Concatenating a freed string.");
+        rt_fail(state);
+    }
+    return value_str(concat_strings(state, str_b->data, str_a->data));
+}
+
+LANTERN_API void
+rt_print(ProgramState* state, RuntimeValue val, bool newline) {
+    if(!print_value(state, val, newline)) {
+        RUNTIME_ERR(true, ERR_INVALID_PTR, "Printing a freed value.");
+        rt_fail(state);
+    }
+}
+
+LANTERN_API void
+rt_print_int(ProgramState* state, int32_t val, bool newline) {
+    print_value(state, value_int(val), newline);
+}
+
+LANTERN_API int32_t
+rt_divide(ProgramState* state, uint32_t inst, int32_t b, int32_t a) {
+    if(a == 0) {
+        RUNTIME_ERR(true, ERR_DIVISION_BY_ZERO, "Division by zero.");
+        rt_fail(state);
+    }
+    return divide_ints(inst, b, a);
+}
+
+LANTERN_API RuntimeValue
+rt_alloc(ProgramState* state, int32_t length, uint32_t type) {
+    if(length < 0) {
+        RUNTIME_ERR(true, ERR_INVALID_DATA_TYPE, "Invalid length for allocating block.");
+        rt_fail(state);
+    }
+    return value_ptr(alloc_block(state, length, type));
+}
+
+// The data of a block for pget or pset, which fails once it was freed.
+LANTERN_API void*
+rt_data(ProgramState* state, RuntimeValue ptr, bool set) {
+    HeapValue* block = heap_get(state, ptr);
+    if(!block || block->kind != HEAP_SLOT_BLOCK) {
+        RUNTIME_ERR(true, ERR_INVALID_PTR, "Invalid pointer for %s.", set ? "pset" : "pget");
+        rt_fail(state);
+    }
+    return block->data;
+}
+
+// The checks pget and pset make with --check-bounds.
+LANTERN_API void
+rt_check_index(ProgramState* state, RuntimeValue ptr, int32_t index, bool set) {
+    rt_data(state, ptr, set);
+    HeapValue* block = heap_get(state, ptr);
+    if((uint32_t)index >= block_length(block)) {
+        RUNTIME_ERR(true, ERR_OUT_OF_BOUNDS, "Index %i out of bounds for %s on block of length %u.", 
+                    index, set ? "pset" : "pget", block_length(block));
+        rt_fail(state);
+    }
+}
+
+// Fails a pwhile min or max over no iterations.
+LANTERN_API void
+rt_empty_range(ProgramState* state) {
+    RUNTIME_ERR(true, ERR_OUT_OF_BOUNDS, "Minimum or maximum of an empty range.");
+    rt_fail(state);
+}
+
+// Runs 'inst' on 'args' in the interpreter and returns the int it leaves
+// on the stack, if any.
+LANTERN_API int32_t
+rt_run(ProgramState* state, uint32_t inst, const RuntimeValue* args, uint32_t count) {
+    uint8_t insts[2] = { inst, INST_HALT };
+    RuntimeValue operands[2] = {0};
+    Program program = { .insts = insts, .operands = operands, .size = 1 };
+    while(state->stack_cap < count + 2) grow_stack(state);
+    memcpy(state->stack + 1, args, sizeof(RuntimeValue) * count);
+    state->stack_size = count;
+    state->inst_ptr = 0;
+    if(!exec_program(state, &program)) 
+        rt_fail(state);
+    int32_t result = state->stack_size > 0 ? value_payload(state->stack[state->stack_size]) : 0;
+    state->stack_size = 0;
+    return result;
+}
+
+// Types of values in compiled programs. Blocks are followed by one type 
+// per element type, so a block of strings is CTYPE_BLOCK + ELEM_STR.
+typedef enum {
+    CTYPE_INT,
+    CTYPE_STR,
+    CTYPE_BLOCK
+} CType;
+
+#define C_NAME_SIZE 32
+
+const char* c_elem_types[ELEM_STR + 1] = { 
+    [ELEM_I8] = "int8_t", [ELEM_I16] = "int16_t", [ELEM_I32] = "int32_t", 
+    [ELEM_I64] = "int64_t", [ELEM_STR] = "RuntimeValue" 
+};
+const char* c_elem_suffixes[ELEM_STR + 1] = { "i8", "i16", "i32", "i64", "str" };
+
+const char* c_operators[INST_COUNT] = {
+    [INST_PLUS] = "+", [INST_MINUS] = "-", [INST_MUL] = "*", [INST_DIV] = "/", [INST_MOD] = "%",
+    [INST_EQ] = "==", [INST_NEQ] = "!=", [INST_GT] = ">", [INST_LT] = "<", [INST_GEQ] = ">=", [INST_LEQ] = "<=",
+    [INST_LOGICAL_AND] = "&&", [INST_LOGICAL_OR] = "||"
+};
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t cap;
+} TextBuffer;
+
+// An if chain or loop being compiled.
+typedef struct {
+    bool loop;
+    // Whether the last branch has a condition, which elif and else need. 
+    // For loops, whether run was seen, which pwhile loops start with.
+    bool open;
+    // Closing braces the end of the block writes.
+    uint32_t braces;
+} CBlock;
+
+typedef struct {
+    const Program* program;
+    bool check_bounds;
+    // Whether the program frees blocks. pget and pset then check the block
+    // every time instead of using the data looked up by alloc.
+    bool frees;
+    TextBuffer body;
+    uint32_t indent;
+    // Why the program cannot be compiled and the token it is about.
+    const char* error;
+    uint32_t error_token;
+
+    // The type of each value on the stack, and per depth a bit for each
+    // type a local was needed for.
+    uint8_t* stack;
+    uint32_t depth;
+    uint8_t* slots_used;
+    // The stack at tokens control flow jumps to, recorded by the first edge
+    // and checked against the others.
+    uint8_t** joins;
+    uint32_t* join_depths;
+
+    // The declaring token of the variable in each stackframe slot, and per
+    // declaring token its type and for strings its root.
+    uint32_t* slot_decls;
+    uint8_t* decl_types;
+    uint32_t* decl_roots;
+    uint32_t str_vars;
+
+    RuntimeValue* literals;
+    uint32_t literal_count;
+    uint32_t literal_cap;
+    CBlock* blocks;
+    uint32_t block_count;
+    uint32_t block_cap;
+} CEmitter;
+
+void
+c_line(CEmitter* c, const char* format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    size_t len = (c->indent + 1) * 4 + strlen(line) + 1;
+    if(c->body.size + len + 1 > c->body.cap) {
+        c->body.cap = (c->body.size + len + 1) * 2;
+        c->body.data = realloc(c->body.data, c->body.cap);
+    }
+    c->body.size += sprintf(c->body.data + c->body.size, "%*s%s\n", (c->indent + 1) * 4, "", line);
+}
+
+bool
+c_fail(CEmitter* c, uint32_t i, const char* error) {
+    if(!c->error) {
+        c->error = error;
+        c->error_token = i;
+    }
+    return false;
+}
+
+// Writes the name of the local holding a value of 'type' at 'depth'.
+void
+c_slot(CEmitter* c, char* name, uint32_t depth, uint8_t type) {
+    c->slots_used[depth] |= 1u << type;
+    if(type == CTYPE_INT) snprintf(name, C_NAME_SIZE, "i%u", depth);
+    else if(type == CTYPE_STR) snprintf(name, C_NAME_SIZE, "ss[%u]", depth);
+    else snprintf(name, C_NAME_SIZE, "p%u_%s", depth, c_elem_suffixes[type - CTYPE_BLOCK]);
+}
+
+void
+c_var(const CEmitter* c, char* name, uint32_t decl) {
+    if(c->decl_types[decl] == CTYPE_STR) snprintf(name, C_NAME_SIZE, "sv[%u]", c->decl_roots[decl]);
+    else snprintf(name, C_NAME_SIZE, "v%u", decl);
+}
+
+// Copies a value between locals, blocks along with their data.
+void
+c_copy(CEmitter* c, const char* dst, const char* src, uint8_t type) {
+    c_line(c, "%s = %s;", dst, src);
+    if(type >= CTYPE_BLOCK) c_line(c, "%s_data = %s_data;", dst, src);
+}
+
+// Records the stack at 'target', or checks it against the recorded one.
+void
+c_join(CEmitter* c, uint32_t target, uint32_t i) {
+    if(!c->joins[target]) {
+        c->joins[target] = malloc(c->depth + 1);
+        memcpy(c->joins[target], c->stack, c->depth);
+        c->join_depths[target] = c->depth;
+    } else if(c->join_depths[target] != c->depth || memcmp(c->joins[target], c->stack, c->depth) != 0) {
+        c_fail(c, i, "values of different types meet after it");
+    }
+}
+
+uint32_t
+c_literal(CEmitter* c, RuntimeValue literal) {
+    for(uint32_t i = 0; i < c->literal_count; i++) {
+        if(c->literals[i] == literal) return i;
+    }
+    GROW_ARRAY(c->literals, c->literal_count, c->literal_cap);
+    c->literals[c->literal_count] = literal;
+    return c->literal_count++;
+}
+
+// Hands an instruction to the interpreter with its operands boxed.
+bool
+c_fallback(CEmitter* c, Instruction inst) {
+    const StackEffect* effect = &stack_effects[inst];
+    char args[256] = "";
+    for(uint32_t d = c->depth - effect->pops; d < c->depth; d++) {
+        char name[C_NAME_SIZE];
+        c_slot(c, name, d, c->stack[d]);
+        size_t len = strlen(args);
+        snprintf(args + len, sizeof(args) - len, c->stack[d] == CTYPE_INT ? "%srt_int(%s)" : "%s%s", 
+                 len ? ", " : "", name);
+    }
+    c->depth -= effect->pops;
+    char call[384];
+    snprintf(call, sizeof(call), "rt_run(state, %u, (RuntimeValue[]){ %s }, %u);", inst, args, effect->pops);
+    if(effect->pushes) {
+        char result[C_NAME_SIZE];
+        c->stack[c->depth] = CTYPE_INT;
+        c_slot(c, result, c->depth++, CTYPE_INT);
+        c_line(c, "%s = %s // %s", result, call, inst_names[inst]);
+    } else {
+        c_line(c, "%s // %s", call, inst_names[inst]);
+    }
+    return true;
+}
+
+bool
+c_binary_op(CEmitter* c, uint32_t i, Instruction inst) {
+    uint32_t d = --c->depth;
+    uint8_t type = c->stack[d];
+    if(type != c->stack[d - 1] || type > CTYPE_STR || (type == CTYPE_STR && inst != INST_PLUS && 
+       inst != INST_EQ && inst != INST_NEQ))
+        return c_fail(c, i, "its operands are not two ints or two strings");
+    char a[C_NAME_SIZE], b[C_NAME_SIZE], result[C_NAME_SIZE];
+    c_slot(c, a, d, type);
+    c_slot(c, b, d - 1, type);
+    if(type == CTYPE_STR && inst == INST_PLUS) {
+        c_line(c, "%s = rt_concat(state, %s, %s);", b, b, a);
+        return true;
+    }
+    c->stack[d - 1] = CTYPE_INT;
+    c_slot(c, result, d - 1, CTYPE_INT);
+    // Ints wrap around like they do in the interpreter.
+    if(inst == INST_PLUS || inst == INST_MINUS || inst == INST_MUL)
+        c_line(c, "%s = (int32_t)((uint32_t)%s %s (uint32_t)%s);", result, b, c_operators[inst], a);
+    else if(inst == INST_DIV || inst == INST_MOD)
+        c_line(c, "%s = rt_divide(state, %u, %s, %s);", result, inst, b, a);
+    else
+        c_line(c, "%s = %s %s %s;", result, b, c_operators[inst], a);
+    return true;
+}
+
+bool
+c_instruction(CEmitter* c, uint32_t i) {
+    const Program* program = c->program;
+    Instruction inst = program->insts[i];
+    RuntimeValue operand = program->operands[i];
+    uint8_t* stack = c->stack;
+    uint32_t d = c->depth;
+    CBlock* block = c->block_count ? &c->blocks[c->block_count - 1] : NULL;
+    char a[C_NAME_SIZE], b[C_NAME_SIZE], x[C_NAME_SIZE];
+    switch(inst) {
+        case INST_STACK_PUSH:
+            if(value_tag(operand) == VALUE_TAG_STR) {
+                stack[d] = CTYPE_STR;
+                c_slot(c, a, d, CTYPE_STR);
+                c_line(c, "%s = lit[%u];", a, c_literal(c, operand));
+            } else {
+                stack[d] = CTYPE_INT;
+                c_slot(c, a, d, CTYPE_INT);
+                if(value_payload(operand) == INT32_MIN) c_line(c, "%s = INT32_MIN;", a);
+                else c_line(c, "%s = %d;", a, value_payload(operand));
+            }
+            c->depth++;
+            return true;
+        case INST_STACK_PREV:
+            stack[d - 1] = stack[d - 2];
+            c_slot(c, a, d - 1, stack[d - 1]);
+            c_slot(c, b, d - 2, stack[d - 2]);
+            c_copy(c, a, b, stack[d - 1]);
+            return true;
+        case INST_PLUS: case INST_MINUS: case INST_MUL: case INST_DIV: case INST_MOD:
+        case INST_EQ: case INST_NEQ: case INST_GT: case INST_LT: case INST_GEQ: case INST_LEQ:
+        case INST_LOGICAL_AND: case INST_LOGICAL_OR:
+            return c_binary_op(c, i, inst);
+        case INST_PRINT:
+        case INST_PRINTLN:
+            c->depth--;
+            c_slot(c, a, d - 1, stack[d - 1]);
+            if(stack[d - 1] == CTYPE_INT)
+                c_line(c, "rt_print_int(state, %s, %s);", a, inst == INST_PRINTLN ? "true" : "false");
+            else
+                c_line(c, "rt_print(state, %s, %s);", a, inst == INST_PRINTLN ? "true" : "false");
+            return true;
+        case INST_IF:
+        case INST_THEN:
+        case INST_RUN_WHILE:
+            if(stack[d - 1] != CTYPE_INT) return c_fail(c, i, "its condition is not an int");
+            if(inst == INST_THEN && (!block || block->loop || block->open))
+                return c_fail(c, i, "it does not follow elif");
+            if(inst == INST_RUN_WHILE && (!block || !block->loop || block->open))
+                return c_fail(c, i, "it does not belong to a loop");
+            c->depth--;
+            c_slot(c, a, d - 1, CTYPE_INT);
+            c_join(c, operand, i);
+            if(inst == INST_RUN_WHILE) {
+                c_line(c, "if(!%s) break;", a);
+                block->open = true;
+                return true;
+            }
+            c_line(c, "if(%s) {", a);
+            c->indent++;
+            if(inst == INST_IF) {
+                GROW_ARRAY(c->blocks, c->block_count, c->block_cap);
+                c->blocks[c->block_count++] = (CBlock){ .open = true, .braces = 1 };
+            } else {
+                block->open = true;
+                block->braces++;
+            }
+            return true;
+        case INST_ELIF:
+        case INST_ELSE:
+            if(!block || block->loop || !block->open) 
+                return c_fail(c, i, "the branch before it has no condition");
+            block->open = false;
+            c_join(c, operand, i);
+            c->indent--;
+            c_line(c, "} else {");
+            c->indent++;
+            return true;
+        case INST_ENDIF:
+            for(uint32_t j = 0; j < block->braces; j++) {
+                c->indent--;
+                c_line(c, "}");
+            }
+            c->block_count--;
+            return true;
+        case INST_WHILE:
+            GROW_ARRAY(c->blocks, c->block_count, c->block_cap);
+            c->blocks[c->block_count++] = (CBlock){ .loop = true, .braces = 1 };
+            c_join(c, i + 1, i);
+            c_line(c, "for(;;) {");
+            c->indent++;
+            return true;
+        case INST_END_WHILE:
+            if(!block->open) return c_fail(c, i, "its loop has no run");
+            c_join(c, operand, i);
+            c->indent--;
+            c_line(c, "}");
+            c->block_count--;
+            return true;
+        case INST_PWHILE: {
+            // Iterations run in order, the reduction is folded into r<end>
+            // after each of them.
+            if(stack[d - 1] != CTYPE_INT || stack[d - 2] != CTYPE_INT) 
+                return c_fail(c, i, "its range is not two ints");
+            uint32_t end = operand - 1;
+            Instruction reduction = PWHILE_REDUCTION(program->operands[end]);
+            if(reduction == INST_MIN || reduction == INST_MAX) c_line(c, "if(i0 >= i1) rt_empty_range(state);");
+            if(reduction) 
+                c_line(c, "int32_t r%u = %s;", end, reduction == INST_MIN ? "INT32_MAX" : 
+                       reduction == INST_MAX ? "INT32_MIN" : "0");
+            c_line(c, "for(int32_t n%u = i0, e%u = i1; n%u < e%u; n%u++) { // pwhile", end, end, end, end, end);
+            c->indent++;
+            c_line(c, "i0 = n%u;", end);
+            c->depth = 1;
+            GROW_ARRAY(c->blocks, c->block_count, c->block_cap);
+            c->blocks[c->block_count++] = (CBlock){ .loop = true, .open = true, .braces = 1 };
+            return true;
+        }
+        case INST_END_PWHILE: {
+            Instruction reduction = PWHILE_REDUCTION(operand);
+            if(reduction && stack[0] != CTYPE_INT) return c_fail(c, i, "an iteration does not leave an int");
+            if(reduction == INST_SUM) c_line(c, "r%u = (int32_t)((uint32_t)r%u + (uint32_t)i0);", i, i);
+            else if(reduction) c_line(c, "if(i0 %s r%u) r%u = i0;", reduction == INST_MIN ? "<" : ">", i, i);
+            c->indent--;
+            c_line(c, "}");
+            c->block_count--;
+            c->depth = 0;
+            if(reduction) {
+                stack[c->depth++] = CTYPE_INT;
+                c_line(c, "i0 = r%u;", i);
+            }
+            return true;
+        }
+        case INST_VAR_USAGE: {
+            uint32_t decl = c->slot_decls[operand];
+            stack[d] = c->decl_types[decl];
+            c_slot(c, a, d, stack[d]);
+            c_var(c, b, decl);
+            c_copy(c, a, b, stack[d]);
+            c->depth++;
+            return true;
+        }
+        case INST_ADD_VAR_TO_STACKFRAME:
+            c->decl_types[i] = stack[d - 1];
+            if(stack[d - 1] == CTYPE_STR) c->decl_roots[i] = c->str_vars++;
+            c->slot_decls[operand] = i;
+            /* fall through */
+        case INST_VAR_REASSIGN: {
+            uint32_t decl = c->slot_decls[operand];
+            if(c->decl_types[decl] != stack[d - 1]) 
+                return c_fail(c, i, "it gives a variable a value of another type");
+            c->depth--;
+            c_var(c, a, decl);
+            c_slot(c, b, d - 1, stack[d - 1]);
+            c_copy(c, a, b, stack[d - 1]);
+            return true;
+        }
+        case INST_HEAP_ALLOC: {
+            if(stack[d - 1] != CTYPE_INT) return c_fail(c, i, "its length is not an int");
+            // The type word before alloc carries the element type.
+            ElementType elem = program->operands[i - 1];
+            c_slot(c, a, d - 1, CTYPE_INT);
+            stack[d - 1] = CTYPE_BLOCK + elem;
+            c_slot(c, b, d - 1, stack[d - 1]);
+            c_line(c, "%s = rt_alloc(state, %s, %u);", b, a, elem);
+            c_line(c, "%s_data = rt_data(state, %s, false);", b, b);
+            return true;
+        }
+        case INST_PTR_GET_I: {
+            // Anything but a block makes pget fail, which the interpreter 
+            // reports.
+            if(stack[d - 1] < CTYPE_BLOCK) return c_fallback(c, inst);
+            if(stack[d - 2] != CTYPE_INT) return c_fail(c, i, "its index is not an int");
+            ElementType elem = stack[d - 1] - CTYPE_BLOCK;
+            uint8_t type = elem == ELEM_STR ? CTYPE_STR : CTYPE_INT;
+            c_slot(c, a, d - 1, stack[d - 1]);
+            c_slot(c, b, d - 2, CTYPE_INT);
+            c_slot(c, x, d - 2, type);
+            if(c->check_bounds) c_line(c, "rt_check_index(state, %s, %s, false);", a, b);
+            else if(c->frees) c_line(c, "%s_data = rt_data(state, %s, false);", a, a);
+            c_line(c, "%s = %s%s_data[(uint32_t)%s];", x, elem == ELEM_I64 ? "(int32_t)" : "", a, b);
+            stack[d - 2] = type;
+            c->depth--;
+            return true;
+        }
+        case INST_PTR_SET_I: {
+            ElementType elem = stack[d - 1] - CTYPE_BLOCK;
+            if(stack[d - 1] < CTYPE_BLOCK || stack[d - 2] != CTYPE_INT || 
+               stack[d - 3] != (elem == ELEM_STR ? CTYPE_STR : CTYPE_INT))
+                return c_fallback(c, inst);
+            c_slot(c, a, d - 1, stack[d - 1]);
+            c_slot(c, b, d - 2, CTYPE_INT);
+            c_slot(c, x, d - 3, stack[d - 3]);
+            if(c->check_bounds) c_line(c, "rt_check_index(state, %s, %s, true);", a, b);
+            else if(c->frees) c_line(c, "%s_data = rt_data(state, %s, true);", a, a);
+            c_line(c, "%s_data[(uint32_t)%s] = (%s)%s;", a, b, c_elem_types[elem], x);
+            c->depth -= 3;
+            return true;
+        }
+        case INST_HEAP_FREE:
+        case INST_FILL: case INST_COPY: case INST_COMPARE: 
+        case INST_SUM: case INST_MIN: case INST_MAX: case INST_SORT:
+            return c_fallback(c, inst);
+        case INST_ASSIGN:
+        case INST_INT_TYPE:
+        case INST_STR_TYPE:
+            return true;
+        default:
+            return c_fail(c, i, "it has no translation to C");
+    }
+}
+
+// Writes a string as a C literal.
+void
+write_c_string(FILE* file, const String* str) {
+    fputc('"', file);
+    for(uint32_t i = 0; i < str->len; i++) {
+        unsigned char ch = str->data[i];
+        if(ch == '"' || ch == '\\' || ch == '?' || ch < ' ' || ch > '~') fprintf(file, "\\%03o", ch);
+        else fputc(ch, file);
+    }
+    fputc('"', file);
+}
+
+void
+write_c_program(FILE* file, const CEmitter* c, const char* script, const ProgramState* state) {
+    uint32_t str_slots = 0;
+    for(uint32_t d = 0; d <= c->program->size; d++) {
+        if(c->slots_used[d] & (1u << CTYPE_STR)) str_slots = d + 1;
+    }
+    fprintf(file, "// Compiled from %s by lantern --emit-c. Build it against liblantern,\n", script);
+    fprintf(file, "// made by 'make lib':\n");
+    fprintf(file, "//   gcc -O2 <this file> bin/liblantern.a -pthread\n");
+    fprintf(file, "#include <stdint.h>\n#include <stdbool.h>\n\n%s\n", rt_declarations);
+    fprintf(file, "int\nmain(void) {\n");
+    fprintf(file, "    ProgramState* state = rt_start(%u, %u);\n", LNTC_VERSION, c->str_vars + str_slots);
+    if(c->str_vars) fprintf(file, "    RuntimeValue* sv = rt_roots(state);\n");
+    if(str_slots) fprintf(file, "    RuntimeValue* ss = rt_roots(state) + %u;\n", c->str_vars);
+    if(c->literal_count) fprintf(file, "    RuntimeValue lit[%u];\n", c->literal_count);
+    for(uint32_t i = 0; i < c->literal_count; i++) {
+        const String* str = state->heap[(uint32_t)c->literals[i]].data;
+        fprintf(file, "    lit[%u] = rt_literal(state, ", i);
+        write_c_string(file, str);
+        fprintf(file, ", %u);\n", str->len);
+    }
+    for(uint32_t i = 0; i < c->program->size; i++) {
+        if(c->program->insts[i] != INST_ADD_VAR_TO_STACKFRAME || c->decl_types[i] == CTYPE_STR) continue;
+        if(c->decl_types[i] == CTYPE_INT) {
+            fprintf(file, "    int32_t v%u = 0;\n", i);
+        } else {
+            fprintf(file, "    RuntimeValue v%u = 0;\n", i);
+            fprintf(file, "    %s* v%u_data = 0;\n", c_elem_types[c->decl_types[i] - CTYPE_BLOCK], i);
+            fprintf(file, "    (void)v%u;\n", i);
+        }
+    }
+    for(uint32_t d = 0; d <= c->program->size; d++) {
+        if(c->slots_used[d] & (1u << CTYPE_INT)) fprintf(file, "    int32_t i%u = 0;\n", d);
+        for(uint32_t elem = ELEM_I8; elem <= ELEM_STR; elem++) {
+            if(!(c->slots_used[d] & (1u << (CTYPE_BLOCK + elem)))) continue;
+            fprintf(file, "    RuntimeValue p%u_%s = 0;\n", d, c_elem_suffixes[elem]);
+            fprintf(file, "    %s* p%u_%s_data = 0;\n", c_elem_types[elem], d, c_elem_suffixes[elem]);
+            fprintf(file, "    (void)p%u_%s;\n", d, c_elem_suffixes[elem]);
+        }
+    }
+    // Block handles are only read by free, the bulk words and checks.
+    fprintf(file, "\n");
+    fwrite(c->body.data, 1, c->body.size, file);
+    fprintf(file, "    return rt_finish(state);\n}\n");
+}
+
+// Compiles a verified program to C. Each value on the stack and each 
+// variable becomes a C local of one type, so programs where a value can
+// have different types at the same place are rejected.
+bool
+emit_c_program(const char* path, const char* script, const Program* program, const ProgramState* state, 
+               bool check_bounds) {
+    uint32_t size = program->size + 1;
+    CEmitter c = { .program = program, .check_bounds = check_bounds };
+    for(uint32_t i = 0; i < program->size; i++) {
+        if(program->insts[i] == INST_HEAP_FREE) c.frees = true;
+    }
+    c.stack = calloc(size, sizeof(uint8_t));
+    c.slots_used = calloc(size, sizeof(uint8_t));
+    c.joins = calloc(size, sizeof(uint8_t*));
+    c.join_depths = calloc(size, sizeof(uint32_t));
+    c.slot_decls = calloc(program->frame_slots + 1, sizeof(uint32_t));
+    c.decl_types = calloc(size, sizeof(uint8_t));
+    c.decl_roots = calloc(size, sizeof(uint32_t));
+    // After elif, else and the end of a loop, code is only reached by a jump.
+    bool reachable = true;
+    for(uint32_t i = 0; i < program->size && !c.error; i++) {
+        if(c.joins[i] && reachable) {
+            c_join(&c, i, i);
+        } else if(c.joins[i]) {
+            c.depth = c.join_depths[i];
+            memcpy(c.stack, c.joins[i], c.depth);
+        } else if(!reachable) {
+            c_fail(&c, i, "it is never reached");
+            break;
+        }
+        Instruction inst = program->insts[i];
+        reachable = inst != INST_ELIF && inst != INST_ELSE && inst != INST_END_WHILE;
+        c_instruction(&c, i);
+    }
+
+    bool ok = !c.error;
+    if(c.error) {
+        printf("Lantern: [Error]: ");
+        if(program->positions) 
+            printf("%s:%u:%u: ", script, program->positions[c.error_token].line, program->positions[c.error_token].column);
+        printf("Cannot compile '%s' to C, %s.\n", inst_names[program->insts[c.error_token]], c.error);
+    } else {
+        FILE* file = fopen(path, "w");
+        if(file) {
+            write_c_program(file, &c, script, state);
+            ok = fclose(file) == 0;
+        }
+        if(!file || !ok) {
+            printf("Lantern: [Error]: Cannot write '%s'.\n", path);
+            ok = false;
+        }
+    }
+    for(uint32_t i = 0; i < size; i++) free(c.joins[i]);
+    free(c.joins);
+    free(c.join_depths);
+    free(c.stack);
+    free(c.slots_used);
+    free(c.slot_decls);
+    free(c.decl_types);
+    free(c.decl_roots);
+    free(c.literals);
+    free(c.blocks);
+    free(c.body.data);
+    return ok;
+}
+
+#ifndef LANTERN_LIBRARY
+// --jobs runs the scripts listed in a file on a pool of threads. Every
+// script is compiled once and shared by the workers, which each run it in a
+// VM of their own, so nothing they write is shared. The output of each run
+// is collected and written out in the order of the list.
+typedef struct {
+    const LanternProgram* program;
+    char* output;
+    size_t output_size;
+    size_t output_cap;
+    bool ok;
+    bool done;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    uint32_t count;
+    uint32_t next;
+    LanternOptions options;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+} JobQueue;
+
+typedef struct {
+    char* path;
+    // NULL when the script does not compile, its runs then print 'errors'.
+    LanternProgram* program;
+    char* errors;
+    size_t errors_size;
+} JobScript;
+
+// Allocations of the job runner itself, which no VM is charged for.
+void*
+job_alloc(void* ptr, size_t size, const char* what) {
+    void* allocated = realloc(ptr, size ? size : 1);
+    if(!allocated) {
+        fprintf(stderr, "Lantern: [Error]: Cannot allocate %zu bytes for %s.\n", size, what);
+        exit(1);
+    }
+    return allocated;
+}
+
+void
+collect_job_output(void* context, const char* data, size_t size) {
+    Job* job = context;
+    if(job->output_size + size > job->output_cap) {
+        size_t cap = job->output_cap ? job->output_cap : 256;
+        while(cap < job->output_size + size) cap *= 2;
+        job->output = job_alloc(job->output, cap, "the output of a job");
+        job->output_cap = cap;
+    }
+    memcpy(job->output + job->output_size, data, size);
+    job->output_size += size;
+}
+
+// Compiles a script of the list. What the compiler prints goes into the
+// script instead of stdout, so the errors of a script that does not compile
+// are written out in list order with the output of the other runs.
+void
+compile_job_script(JobScript* script) {
+    fflush(stdout);
+    FILE* capture = tmpfile();
+    int saved = capture ? dup(STDOUT_FILENO) : -1;
+    bool captured = saved >= 0 && dup2(fileno(capture), STDOUT_FILENO) >= 0;
+    script->program = lantern_compile_file(script->path);
+    fflush(stdout);
+    if(captured) {
+        dup2(saved, STDOUT_FILENO);
+        long size = ftell(capture);
+        script->errors = job_alloc(NULL, size > 0 ? size : 0, "the errors of a script");
+        rewind(capture);
+        script->errors_size = size > 0 ? fread(script->errors, 1, size, capture) : 0;
+    }
+    if(saved >= 0) close(saved);
+    if(capture) fclose(capture);
+}
+
+void*
+run_jobs_worker(void* arg) {
+    JobQueue* queue = arg;
+    // Runs of the same script in a row reuse the VM and the memory it
+    // allocated.
+    LanternVM* vm = NULL;
+    for(;;) {
+        pthread_mutex_lock(&queue->lock);
+        uint32_t index = queue->next < queue->count ? queue->next++ : queue->count;
+        pthread_mutex_unlock(&queue->lock);
+        if(index == queue->count) break;
+
+        Job* job = &queue->jobs[index];
+        if(job->done) continue;
+        if(vm && vm->source != job->program) {
+            lantern_free_vm(vm);
+            vm = NULL;
+        }
+        if(vm) lantern_reset(vm);
+        else vm = lantern_create_vm(job->program, &queue->options);
+        vm->state.output_context = job;
+        bool ok = lantern_run(vm);
+
+        pthread_mutex_lock(&queue->lock);
+        job->ok = ok;
+        job->done = true;
+        pthread_cond_broadcast(&queue->job_done);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    lantern_free_vm(vm);
+    return NULL;
+}
+
+// Reads the script paths from 'list_path', one per line, and runs them on
+// 'thread_count' threads. A script that does not compile fails each of its
+// runs. Returns false when any run fails.
+bool
+run_jobs(const char* list_path, uint32_t thread_count, LanternOptions options, bool stats) {
+    FILE* list = fopen(list_path, "r");
+    if(!list) {
+        printf("Lantern: [Error]: Cannot read file '%s'.\n", list_path);
+        return false;
+    }
+    uint64_t load_start = now_ns();
+    JobQueue queue = { .options = options };
+    uint32_t job_cap = 0;
+    JobScript* scripts = NULL;
+    uint32_t script_count = 0;
+    // Open addressing over 'scripts', indices are stored plus one.
+    uint32_t bucket_count = 64;
+    uint32_t* buckets = job_alloc(NULL, sizeof(uint32_t) * bucket_count, "the script table");
+    memset(buckets, 0, sizeof(uint32_t) * bucket_count);
+    bool ok = true;
+    char line[4096];
+    while(fgets(line, sizeof(line), list)) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if(len == 0) continue;
+        uint32_t bucket = hash_bytes(line, len) & (bucket_count - 1);
+        while(buckets[bucket] && strcmp(scripts[buckets[bucket] - 1].path, line) != 0)
+            bucket = (bucket + 1) & (bucket_count - 1);
+        uint32_t script = buckets[bucket] - 1;
+        if(!buckets[bucket]) {
+            scripts = job_alloc(scripts, sizeof(JobScript) * (script_count + 1), "the script table");
+            char* path = memcpy(job_alloc(NULL, len + 1, "the script table"), line, len + 1);
+            scripts[script_count] = (JobScript){ .path = path };
+            compile_job_script(&scripts[script_count]);
+            script = script_count++;
+            buckets[bucket] = script_count;
+            if(script_count * 2 > bucket_count) {
+                bucket_count *= 2;
+                buckets = job_alloc(buckets, sizeof(uint32_t) * bucket_count, "the script table");
+                memset(buckets, 0, sizeof(uint32_t) * bucket_count);
+                for(uint32_t i = 0; i < script_count; i++) {
+                    uint32_t b = hash_bytes(scripts[i].path, strlen(scripts[i].path)) & (bucket_count - 1);
+                    while(buckets[b]) b = (b + 1) & (bucket_count - 1);
+                    buckets[b] = i + 1;
+                }
+            }
+        }
+        if(queue.count == job_cap) {
+            job_cap = job_cap ? job_cap * 2 : 64;
+            queue.jobs = job_alloc(queue.jobs, sizeof(Job) * job_cap, "the job list");
+        }
+        Job* job = &queue.jobs[queue.count++];
+        *job = (Job){ .program = scripts[script].program, .done = !scripts[script].program };
+        if(job->done && scripts[script].errors_size) 
+            collect_job_output(job, scripts[script].errors, scripts[script].errors_size);
+    }
+    fclose(list);
+    free(buckets);
+
+    uint64_t exec_start = now_ns();
+    if(queue.count) {
+        if(thread_count > queue.count) thread_count = queue.count;
+        pthread_mutex_init(&queue.lock, NULL);
+        pthread_cond_init(&queue.job_done, NULL);
+        pthread_t* threads = job_alloc(NULL, sizeof(pthread_t) * thread_count, "the worker threads");
+        uint32_t started = 0;
+        while(started < thread_count && pthread_create(&threads[started], NULL, run_jobs_worker, &queue) == 0)
+            started++;
+        if(!started) {
+            fprintf(stderr, "Lantern: [Warning]: Cannot start worker threads, running the jobs in order.\n");
+            run_jobs_worker(&queue);
+        }
+        for(uint32_t i = 0; i < queue.count; i++) {
+            Job* job = &queue.jobs[i];
+            pthread_mutex_lock(&queue.lock);
+            while(!job->done) pthread_cond_wait(&queue.job_done, &queue.lock);
+            pthread_mutex_unlock(&queue.lock);
+            write_all(STDOUT_FILENO, job->output, job->output_size);
+            free(job->output);
+            ok = ok && job->ok;
+        }
+        for(uint32_t i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        free(threads);
+        pthread_cond_destroy(&queue.job_done);
+        pthread_mutex_destroy(&queue.lock);
+        thread_count = started ? started : 1;
+    }
+    uint64_t end = now_ns();
+    if(stats) {
+        fprintf(stderr, "Lantern: [Stats]: load: %.3f ms, exec: %.3f ms, peak rss: %ld KB\n",
+                (exec_start - load_start) / 1e6, (end - exec_start) / 1e6, peak_rss_kb());
+        fprintf(stderr, "Lantern: [Stats]: jobs: %u, scripts: %u, runs: %u, runs per second: %.1f\n",
+                thread_count, script_count, queue.count, 
+                end > exec_start ? queue.count / ((end - exec_start) / 1e9) : 0.0);
+    }
+    for(uint32_t i = 0; i < script_count; i++) {
+        lantern_free_program(scripts[i].program);
+        free(scripts[i].path);
+        free(scripts[i].errors);
+    }
+    free(scripts);
+    free(queue.jobs);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const char* usage = "Usage: ./lantern [-O0|-O1] [--no-cache] [--cache-dir <dir>] [--max-memory <size>]"
+        " [--output-buffer <size>] [--line-buffered] [--check-bounds] [--stats]"
+        " [--profile] [--profile-folded <file>] [--jit] [--emit-c <file>] [--threads <n>] [--jobs <n>]"
+        " <filepath | --inputs <list>>";
+    const char* filepath = NULL;
+    const char* cache_dir = NULL;
+    bool use_cache = true;
+    bool optimize = true;
+    bool stats = false;
+    bool check_bounds = false;
+    bool profiling = false;
+    bool jit = false;
+    const char* folded_path = NULL;
+    const char* emit_path = NULL;
+    const char* inputs_path = NULL;
+    uint32_t jobs = 0;
+    uint32_t threads = 0;
+    bool line_buffered = isatty(STDOUT_FILENO);
+    size_t memory_limit = 0;
+    size_t output_buffer_size = 64 * 1024;
+    for(int32_t i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0) {
+            optimize = argv[i][2] == '1';
+        } else if(strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        } else if(strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if(strcmp(argv[i], "--check-bounds") == 0) {
+            check_bounds = true;
+        } else if(strcmp(argv[i], "--profile") == 0) {
+            profiling = true;
+        } else if(strcmp(argv[i], "--profile-folded") == 0 && i + 1 < argc) {
+            profiling = true;
+            folded_path = argv[++i];
+        } else if(strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if(strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emit_path = argv[++i];
+        } else if(strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+            inputs_path = argv[++i];
+        } else if((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+            bool is_jobs = argv[i][2] == 'j';
+            char* end;
+            long count = strtol(argv[++i], &end, 10);
+            if(*end != '\0' || count < 0 || count > 4096) {
+                printf("Lantern: [Error]: Invalid %s count '%s'.\n", is_jobs ? "job" : "thread", argv[i]);
+                return 1;
+            }
+            if(is_jobs) jobs = count;
+            else threads = count;
+        } else if(strcmp(argv[i], "--line-buffered") == 0) {
+            line_buffered = true;
+        } else if(strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc) {
+            if(!parse_memory_size(argv[++i], &output_buffer_size)) {
+                printf("Lantern: [Error]: Invalid buffer size '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if(strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+            if(!parse_memory_size(argv[++i], &memory_limit)) {
+                printf("Lantern: [Error]: Invalid memory size '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if(argv[i][0] == '-') {
+            printf("Lantern: [Error]: Unknown option '%s'. %s\n", argv[i], usage);
+            return 1;
+        } else if(filepath) {
+            printf("Lantern: [Error]: Too many arguments specified. %s\n", usage);
+            return 1;
+        } else {
+            filepath = argv[i];
+        }
+    }
+    if(inputs_path && !filepath) {
+        // Runs write into buffers of their own, so line buffering does not
+        // apply. The jobs already keep every processor busy, so pwhile 
+        // loops run in order unless told otherwise.
+        LanternOptions options = { .memory_limit = memory_limit, .output_buffer_size = output_buffer_size,
+                                   .check_bounds = check_bounds, .output = collect_job_output, .threads = threads };
+        return run_jobs(inputs_path, jobs ? jobs : cpu_count(), options, stats) ? 0 : 1;
+    }
+    if(!filepath || inputs_path) {
+        printf("Lantern: [Error]: Too %s arguments specified. %s\n", filepath ? "many" : "few", usage);
+        return 1;
+    }
+#ifndef LANTERN_JIT
+    if(jit) fprintf(stderr, "Lantern: [Warning]: --jit is not supported on this platform.\n");
+#endif
+    ProgramState program_state = { .memory_limit = memory_limit, .gc_threshold = GC_MIN_THRESHOLD,
+                                   .line_buffered = line_buffered, .check_bounds = check_bounds,
+                                   .threads = threads ? threads : cpu_count() };
+    program_state.output = checked_alloc(&program_state, NULL, output_buffer_size);
+    program_state.output_cap = output_buffer_size;
+    grow_stack(&program_state);
+
+    SourceInfo source;
+    MappedFile cache = {0};
+    char cache_path[4096];
+    // The cache holds no source positions, so profiled runs and compiling
+    // to C always load the script.
+    bool positions = profiling || emit_path;
+    use_cache = use_cache && !positions && get_source_info(filepath, &source);
+    Program program = {0};
+    bool cached = false;
+    uint64_t load_start = now_ns();
+    if(use_cache) {
+        if(cache_dir) mkdir(cache_dir, 0755);
+        get_cache_path(filepath, cache_dir, cache_path, sizeof(cache_path));
+        cached = load_program_from_cache(cache_path, &source, &program, &program_state, &cache);
+    }
+    if(!cached) {
+        if(!load_program_from_file(filepath, &program, &program_state, positions)) {
+            free_program_state(&program_state);
+            return 1;
+        }
+        crossreference_tokens(&program_state, &program);
+        VerifyResult verified = verify_program(&program_state, &program, program.positions ? filepath : NULL);
+        if(verified == VERIFY_FAILED) {
+            // Load the script again with source positions to report where
+            // the errors are.
+            if(!program.positions) {
+                free_program(&program);
+                load_program_from_file(filepath, &program, &program_state, true);
+                crossreference_tokens(&program_state, &program);
+                verify_program(&program_state, &program, filepath);
+            }
+            free_program(&program);
+            free_program_state(&program_state);
+            return 1;
+        }
+        program.verified = verified == VERIFY_PASSED;
+        if(use_cache) 
+            write_program_cache(cache_path, &source, &program, &program_state);
+    }
+    if(emit_path) {
+        bool emitted = program.verified;
+        if(!emitted) 
+            printf("Lantern: [Error]: Only scripts the verifier proves can be compiled to C.\n");
+        else
+            emitted = emit_c_program(emit_path, filepath, &program, &program_state, check_bounds);
+        free_program(&program);
+        free_program_state(&program_state);
+        return emitted ? 0 : 1;
+    }
+    if(optimize)
+        optimize_program(&program);
+    program_state.program_size = program.size;
+    reserve_stackframe(&program_state, program.frame_slots);
+    Profile profile = {0};
+    if(profiling) {
+        size_t size = sizeof(uint64_t) * (program.size + 1);
+        profile.counts = memset(checked_alloc(&program_state, NULL, size), 0, size);
+        profile.cycles = memset(checked_alloc(&program_state, NULL, size), 0, size);
+        program_state.profile = &profile;
+    }
+#ifdef LANTERN_JIT
+    // Compiled loops execute no tokens one by one, so profiles interpret.
+    JitState jit_state = {0};
+    if(jit && !profiling) {
+        jit_state.loops = calloc(program.size + 1, sizeof(JitLoop*));
+        jit_state.hits = calloc(program.size + 1, sizeof(uint32_t));
+        program_state.jit = &jit_state;
+    }
+#endif
+    uint64_t exec_start = now_ns();
+    bool ok = exec_program(&program_state, &program);
+    flush_output(&program_state);
+    if(profiling) {
+        print_profile(&program, &profile);
+        if(folded_path && !write_folded_profile(folded_path, filepath, &program, &profile))
+            fprintf(stderr, "Lantern: [Error]: Cannot write profile to '%s'.\n", folded_path);
+        free(profile.counts);
+        free(profile.cycles);
+    }
+    if(stats)
+        print_stats(&program_state, exec_start - load_start, now_ns() - exec_start);
+#ifdef LANTERN_JIT
+    if(program_state.jit)
+        free_jit(&jit_state, program.size + 1);
+#endif
+    free_program_state(&program_state);
+    if(cached)
+        unmap_file(&cache);
+    else
+        free_program(&program);
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef LANTERN_H
+#define LANTERN_H
+
+// Embedding Lantern. A script is compiled once into a program, which never
+// changes afterwards, and runs in any number of VMs created against it.
+// Errors are printed to stdout like the interpreter prints them, unless a
+// VM sends its output elsewhere.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// liblantern is built with hidden visibility, so only what is marked with
+// LANTERN_API is exported from it.
+#if defined(__GNUC__)
+#define LANTERN_API __attribute__((visibility("default")))
+#else
+#define LANTERN_API
+#endif
+
+typedef struct LanternProgram LanternProgram;
+typedef struct LanternVM LanternVM;
+
+typedef struct {
+    // Bytes the VM may use before it fails with ERR_OUT_OF_MEMORY, 0 for no
+    // limit.
+    size_t memory_limit;
+    // Size of the output buffer, 0 writes every value immediately.
+    size_t output_buffer_size;
+    // Write the output after every println.
+    bool line_buffered;
+    // Fail with ERR_OUT_OF_BOUNDS when pget or pset index past the end of
+    // a block.
+    bool check_bounds;
+    // Receives the output, runtime errors included, instead of stdout when
+    // set.
+    void (*output)(void* context, const char* data, size_t size);
+    void* output_context;
+    // Threads a pwhile loop may split its range across, 0 and 1 run it in
+    // order.
+    unsigned threads;
+} LanternOptions;
+
+// Compiles a script, 'name' is what errors call it. Returns NULL when the
+// script has errors.
+LANTERN_API LanternProgram* lantern_compile(const char* source, size_t size, const char* name);
+LANTERN_API LanternProgram* lantern_compile_file(const char* path);
+// Frees a program, after every VM running it.
+LANTERN_API void lantern_free_program(LanternProgram* program);
+
+// Creates a VM ready to run 'program'. 'options' may be NULL for a 64K
+// output buffer and no limits.
+LANTERN_API LanternVM* lantern_create_vm(const LanternProgram* program, const LanternOptions* options);
+// Runs the program to its end and writes out its output. Returns false when
+// it stopped with an error.
+LANTERN_API bool lantern_run(LanternVM* vm);
+// Puts the VM back to the state before its first run, keeping the memory it
+// allocated for the next one.
+LANTERN_API void lantern_reset(LanternVM* vm);
+LANTERN_API void lantern_free_vm(LanternVM* vm);
+
+#endif
@@ -1 +1 @@
-gcc ..\lantern.c -o ..\bin\lantern.exe -Wall -Wextra -Werror -O3 -ffast-math
\ No newline at end of file
+gcc ..\lantern.c -o ..\bin\lantern.exe -pthread -Wall -Wextra -Werror -O3 -ffast-math -fno-crossjumping -fno-gcse
\ No newline at end of file
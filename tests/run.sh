@@ -0,0 +1,65 @@
+#!/bin/sh
+# Runs every script in tests/ and compares what it prints, errors included,
+# and its exit code with the .expected file next to it. Each script runs in
+# the interpreter and with --jit, which have to agree, and when it can be
+# compiled to C with --emit-c, as a program built against liblantern too.
+# Last, all of them run as one --inputs batch.
+#
+# Usage: tests/run.sh [lantern] [liblantern.a]
+
+LANTERN=${1:-bin/lantern}
+LIBLANTERN=${2:-bin/liblantern.a}
+TEST_DIR=$(dirname "$0")
+
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+failed=0
+
+# Compares the output in $TMP_DIR/out with the expected one of test $1, run
+# as $2.
+check() {
+    if ! cmp -s "$TEST_DIR/$1.expected" "$TMP_DIR/out"; then
+        echo "FAIL $1 ($2)"
+        diff "$TEST_DIR/$1.expected" "$TMP_DIR/out" | head -20
+        failed=1
+    fi
+}
+
+for script in "$TEST_DIR"/*.lntrn; do
+    name=$(basename "$script" .lntrn)
+    for flags in "" "--jit"; do
+        "$LANTERN" --no-cache $flags "$script" > "$TMP_DIR/out" 2>&1
+        echo "exit: $?" >> "$TMP_DIR/out"
+        check "$name" "${flags:-interpreter}"
+    done
+    if [ -f "$LIBLANTERN" ] && "$LANTERN" --no-cache --emit-c "$TMP_DIR/$name.c" "$script" > /dev/null 2>&1; then
+        if gcc -O2 "$TMP_DIR/$name.c" "$LIBLANTERN" -pthread -o "$TMP_DIR/$name"; then
+            "$TMP_DIR/$name" > "$TMP_DIR/out" 2>&1
+            echo "exit: $?" >> "$TMP_DIR/out"
+            check "$name" "--emit-c"
+        else
+            echo "FAIL $name (--emit-c does not build)"
+            failed=1
+        fi
+    fi
+done
+
+# All of them once more as one batch, which has to print the output of each
+# script in list order and fail since some of them do.
+ls "$TEST_DIR"/*.lntrn > "$TMP_DIR/list"
+for script in $(cat "$TMP_DIR/list"); do
+    grep -v '^exit: ' "${script%.lntrn}.expected"
+done > "$TMP_DIR/batch.expected"
+"$LANTERN" --jobs 4 --inputs "$TMP_DIR/list" > "$TMP_DIR/out" 2>&1
+status=$?
+if [ "$status" -ne 1 ] || ! cmp -s "$TMP_DIR/batch.expected" "$TMP_DIR/out"; then
+    echo "FAIL --inputs (exit: $status)"
+    diff "$TMP_DIR/batch.expected" "$TMP_DIR/out" | head -20
+    failed=1
+fi
+
+if [ "$failed" -eq 0 ]; then
+    echo "All tests passed."
+fi
+exit $failed